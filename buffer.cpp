@@ -24,6 +24,8 @@
 
 using namespace clunk;
 
+Buffer::allocation_hook_type Buffer::allocation_hook = NULL;
+
 void Buffer::fill(const int b) {
 	if (ptr == NULL) 
 		return;
@@ -34,48 +36,74 @@ const Buffer& Buffer::operator=(const Buffer& c) {
 	if (this == &c) 
 		return *this; // same object
 
-	if (c.ptr == NULL) {
+	if (c.size == 0) {
 		free();
 		return *this;
 	}
-	assert(c.size > 0);
 
-	void *p = realloc(ptr, c.size);
-	if (p == NULL) 
-		throw_io(("realloc (%p, %u)", ptr, (unsigned)c.size));
-	ptr = p;
-	size = c.size;
+	set_size(c.size);
 	memcpy(ptr, c.ptr, c.size);
 	return *this;
 }
 
+void Buffer::set_capacity(size_t s) {
+	if (s <= capacity)
+		return;
+	
+	void * x = realloc(ptr, s);
+	if (x == NULL) 
+		throw_io(("realloc (%p, %u)", ptr, (unsigned)s));
+	if (allocation_hook != NULL)
+		allocation_hook(s);
+	ptr = x;
+	capacity = s;
+}
+
 void Buffer::set_size(size_t s) {
 	if (s == size)
 		return;
 	
-	if (s == 0) {
+	if (s > capacity)
+		set_capacity(s < capacity * 2? capacity * 2: s);
+	size = s;
+}
+
+void Buffer::shrink_to_fit() {
+	if (capacity == size)
+		return;
+	
+	if (size == 0) {
 		free();
 		return;
 	}
-
-	void * x = realloc(ptr, s);
+	
+	void * x = realloc(ptr, size);
 	if (x == NULL) 
-		throw_io(("realloc (%p, %u)", ptr, (unsigned)s));
+		throw_io(("realloc (%p, %u)", ptr, (unsigned)size));
 	ptr = x;
-	size = s;
+	capacity = size;
+}
+
+void Buffer::swap(Buffer &other) {
+	void *p = ptr;
+	ptr = other.ptr;
+	other.ptr = p;
+	
+	size_t s = size;
+	size = other.size;
+	other.size = s;
+	
+	s = capacity;
+	capacity = other.capacity;
+	other.capacity = s;
 }
 
 void Buffer::set_data(const void *p, const size_t s) {
 	if (p == NULL || s == 0)
 		throw_ex(("calling set_data(%p, %u) is invalid", p, (unsigned)s));
 
-	void *x = realloc(ptr, s);
-
-	if (x == NULL) 
-		throw_io(("realloc (%p, %d)", ptr, (unsigned)s));
-	ptr = x;
+	set_size(s);
 	memcpy(ptr, p, s);
-	size = s;
 }
 
 void Buffer::set_data(void *p, const size_t s, const bool own) {
@@ -85,13 +113,9 @@ void Buffer::set_data(void *p, const size_t s, const bool own) {
 	if (own) {
 		free();
 		ptr = p;
-		size = s;
+		size = capacity = s;
 	} else {
-		void *x = realloc(ptr, s);
-		if (x == NULL) 
-			throw_io(("realloc(%p, %d)", ptr, (unsigned)s));
-		ptr = x;
-		size = s;
+		set_size(s);
 		memcpy(ptr, p, s);
 	}
 }
@@ -123,12 +147,12 @@ void Buffer::free() {
 	if (ptr != NULL) {
 		::free(ptr);
 		ptr = NULL;
-		size = 0;
+		size = capacity = 0;
 	}
 }
 
 const std::string Buffer::dump() const {
-	if (ptr == NULL)
+	if (size == 0)
 		return "empty memory buffer";
 	assert(ptr != 0);
 	
@@ -169,14 +193,11 @@ const std::string Buffer::dump() const {
 }
 
 void Buffer::pop(size_t n) {
-	if (ptr == NULL)
-		return;
-	
 	if (n >= size) {
-		free();
+		size = 0;
 		return;
 	}
 	
 	memmove(ptr, (unsigned char *)ptr + n, size - n);
-	set_size(size - n);
+	size -= n;
 }
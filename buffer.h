@@ -30,19 +30,27 @@ namespace clunk {
 	\brief Memory buffer
 	This class contains single memory buffer, allocated by malloc. 
 	It auto frees it when it goes out of scope.	
+	Shrinking buffer keeps its memory, so buffer reused with the same sizes does not allocate. 
+	Growing buffer at least doubles its memory, so appending is linear.
 */
 
 class CLUNKAPI Buffer {
 public:
 	//! Default ctor, empty buffer.
-	inline Buffer(): ptr(NULL), size(0) {}
+	inline Buffer(): ptr(NULL), size(0), capacity(0) {}
 	//! Copy ctor
-	inline Buffer(const Buffer& c) : ptr(NULL), size(0) { *this = c; }
+	inline Buffer(const Buffer& c) : ptr(NULL), size(0), capacity(0) { *this = c; }
 	/*!
 		\brief Instantly allocates 'size' memory
 		\param[in] size size of the memory buffer 
 	*/ 
-	inline Buffer(int size): ptr(NULL), size(0) { set_size(size); }
+	inline Buffer(int size): ptr(NULL), size(0), capacity(0) { set_size(size); }
+#ifdef CLUNK_HAS_RVALUE_REFS
+	//! Move ctor, takes memory of the other buffer
+	inline Buffer(Buffer &&c) : ptr(c.ptr), size(c.size), capacity(c.capacity) { c.unlink(); }
+	//! Move operator=, takes memory of the other buffer
+	inline Buffer& operator=(Buffer &&c) { if (this != &c) { free(); swap(c); } return *this; }
+#endif
 
 	//! Destructor, deallocates buffer if needed
 	inline ~Buffer() { free(); }
@@ -55,14 +63,16 @@ public:
 		\brief Tests if buffer was empty
 		\return returns true if the buffer is empty or deallocated.
 	*/
-	inline bool empty() const { return ptr == NULL; }
+	inline bool empty() const { return size == 0; }
+	//! Gets size of the allocated memory
+	inline const size_t get_capacity() const { return capacity; }
 
 	/*! 
 		\brief Leaks buffer's content. Use it with care.
 		Leaks buffer's content. 
 		Useful for exception-safe passing of malloc'ed memory to some library function which later deallocates it.
 	*/
-	inline void unlink() { ptr = NULL; size = 0; }
+	inline void unlink() { ptr = NULL; size = 0; capacity = 0; }
 
 	//! Default operator=
 	const Buffer& operator=(const Buffer& c);
@@ -75,6 +85,15 @@ public:
 		\param[in] s size of the new buffer.
 	*/
 	void set_size(size_t s);
+	/*!
+		\brief Allocates memory for the given size, but does not change size of the buffer
+		\param[in] s number of bytes to be allocated.
+	*/
+	void set_capacity(size_t s);
+	//! Releases memory not used by data
+	void shrink_to_fit();
+	//! Exchanges contents with other buffer without copying data
+	void swap(Buffer &other);
 	/*! \brief Sets buffer content to a given data.
 		Copies given data to the buffer. Note, that functions allocates memory for a new buffer. Do not forget to deallocate 'p' if needed. 
 		\param[in] p source pointer
@@ -109,9 +128,17 @@ public:
 	//! Pops n bytes from the front
 	void pop(size_t n); 
 
+	
+	/*!
+		\brief Function called on every memory allocation made by buffers. 
+		Debugging aid, clunk::Context uses it to count allocations made by the audio callback.
+	*/
+	typedef void (*allocation_hook_type)(size_t size);
+	static allocation_hook_type allocation_hook;
+	
 protected:
 	void *ptr;
-	size_t size;
+	size_t size, capacity;
 };
 
 }
@@ -0,0 +1,85 @@
+#ifndef CLUNK_COMMAND_QUEUE_H__
+#define CLUNK_COMMAND_QUEUE_H__
+
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "clunk_assert.h"
+
+#if defined _MSC_VER
+#	include <intrin.h>
+#	define CLUNK_MEMORY_BARRIER() _ReadWriteBarrier()
+#else
+#	define CLUNK_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+namespace clunk {
+
+/*! 
+	\brief Lock-free single producer, single consumer queue. 
+	Fixed size ring of preallocated items. Producer fills item returned by back() and publishes it with push(), 
+	consumer reads front() and releases it with pop(). Items are reused, nothing is allocated after construction.
+*/
+
+template<typename T, unsigned SIZE>
+class command_queue {
+	clunk_static_assert((SIZE & (SIZE - 1)) == 0);
+
+public: 
+	command_queue() : head(0), tail(0), items(new T[SIZE]) {}
+	~command_queue() { delete[] items; }
+
+	///producer: returns free item or NULL if queue is full
+	T * back() {
+		unsigned t = tail;
+		if (t - head == SIZE)
+			return NULL;
+		CLUNK_MEMORY_BARRIER();
+		return items + (t & (SIZE - 1));
+	}
+	///producer: publishes item returned by back()
+	void push() {
+		CLUNK_MEMORY_BARRIER();
+		tail = tail + 1;
+	}
+	
+	///consumer: returns oldest item or NULL if queue is empty
+	T * front() {
+		unsigned h = head;
+		if (h == tail)
+			return NULL;
+		CLUNK_MEMORY_BARRIER();
+		return items + (h & (SIZE - 1));
+	}
+	///consumer: releases item returned by front()
+	void pop() {
+		CLUNK_MEMORY_BARRIER();
+		head = head + 1;
+	}
+
+private: 
+	command_queue(const command_queue &);
+	const command_queue& operator=(const command_queue &);
+
+	volatile unsigned head, tail;
+	T * items;
+};
+
+}
+
+#endif
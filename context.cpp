@@ -33,10 +33,36 @@
 #include "locker.h"
 #include "stream.h"
 #include "object.h"
+#include "cpu_features.h"
 
 using namespace clunk;
 
-Context::Context() : period_size(0), listener(NULL), max_sources(8), fx_volume(1), distance_model(DistanceModel::Inverse, true, 128), fdump(NULL) {
+//context counting buffer allocations made by its rendering threads, only one audio device may be opened at a time
+static Context *counting_context = NULL;
+
+void Context::count_allocation(size_t) {
+	Context *self = counting_context;
+	if (self != NULL && self->is_rendering_thread())
+		++self->buffer_allocations;
+}
+
+unsigned Context::get_buffer_allocations() const {
+	return buffer_allocations;
+}
+
+bool Context::is_rendering_thread() const {
+	Uint32 id = SDL_ThreadID();
+	for(unsigned i = 0; i < MAX_THREADS; ++i) {
+		if (rendering_threads[i] == id)
+			return true;
+	}
+	return false;
+}
+
+Context::Context() : period_size(0), current_frame(NULL), next_frame(0), sweep_position(0), mix_position(0), listener(NULL), max_sources(8), fx_volume(1), distance_model(DistanceModel::Inverse, true, 128), fdump(NULL), 
+	buffer_allocations(0), workers_done(NULL), workers_exit(false), worker_sources(NULL), resampler_quality(Resampler::Medium) {
+	for(unsigned i = 0; i < MAX_THREADS; ++i)
+		rendering_threads[i] = 0;
 }
 
 void Context::callback(void *userdata, Uint8 *bstream, int len) {
@@ -48,38 +74,84 @@ void Context::callback(void *userdata, Uint8 *bstream, int len) {
 	} CATCH("callback", {})
 }
 
+void Context::mix(float *dst, const Sint16 *src, unsigned n, float gain) {
+	for(unsigned i = 0; i < n; ++i) {
+		dst[i] += src[i] * gain;
+	}
+}
+
+void Context::mix(float *dst, const float *src, unsigned n) {
+	for(unsigned i = 0; i < n; ++i) {
+		dst[i] += src[i];
+	}
+}
+
+void Context::clip(Sint16 *dst, const float *src, unsigned n) {
+	for(unsigned i = 0; i < n; ++i) {
+		float v = src[i];
+		if (v > 32767)
+			v = 32767;
+		else if (v < -32768)
+			v = -32768;
+		dst[i] = (Sint16)floorf(v + 0.5f);
+	}
+}
+
+template<class Sources>
+static void fast_forward(Sources &sources, int dp) {
+	for(typename Sources::iterator i = sources.begin(); i != sources.end(); ++i) {
+		i->second->_update_position(dp);
+	}
+}
+
+bool Context::visit_object(unsigned h, std::vector<source_t> &lsources, unsigned n, bool audible) {
+	Object *o = emitters.object[h];
+	int lag = (int)(mix_position - emitters.mix_position[h]);
+	if (lag > 0) {
+		fast_forward(o->named_sources, lag);
+		fast_forward(o->indexed_sources, lag);
+	}
+	emitters.mix_position[h] = mix_position + n;
+	
+	bool ok_1 = process_object<Object::NamedSources>(h, o->named_sources, lsources, n, audible),
+		ok_2 = process_object<Object::IndexedSources>(h, o->indexed_sources, lsources, n, audible);
+	return ok_1 || ok_2;
+}
+
 template<class Sources>
-bool Context::process_object(Object *o, Sources &sset, std::vector<source_t> &lsources, unsigned n) {
-	typedef typename std::map<typename Sources::key_type, unsigned> stats_type;
-	stats_type sources_stats;
+bool Context::process_object(unsigned h, Sources &sset, std::vector<source_t> &lsources, unsigned n, bool audible) {
+	const v3<float> &listener_position = emitters.position[listener->handle];
 	
+	//sources with the same key are adjacent in the multimap, counting the current run is enough
+	int last_key = 0;
+	unsigned same_sounds_n = 0;
 	for(typename Sources::iterator j = sset.begin(); j != sset.end(); ) {
-		const typename Sources::key_type &name = j->first;
 		Source *s = j->second;
 		if (!s->playing()) {
 			//LOG_DEBUG(("purging inactive source %s", j->first.c_str()));
-			delete j->second;
 			sset.erase(j++);
+			delete s;
 			continue;
 		}
 		
-		typename stats_type::iterator s_i = sources_stats.find(name);
-		unsigned same_sounds_n = (s_i != sources_stats.end())? s_i->second: 0;
-		if (lsources.size() < max_sources && same_sounds_n < distance_model.same_sounds_limit) {
-			lsources.push_back(source_t(s, o->position + s->delta_position - listener->position, o->velocity, o->direction, listener->velocity));
-			if (same_sounds_n == 0) {
-				sources_stats.insert(typename stats_type::value_type(name, 1));
-			} else {
-				++s_i->second;
-			}
-			//LOG_DEBUG(("%u: source: %s", (unsigned)lsources.size(), name.c_str()));
+		if (same_sounds_n == 0 || j->first != last_key) {
+			last_key = j->first;
+			same_sounds_n = 0;
+		}
+		if (audible && lsources.size() < max_sources && same_sounds_n < distance_model.same_sounds_limit) {
+			const v3<float> s_pos = emitters.position[h] + s->delta_position - listener_position;
+			//sources off the object's center have their own distance
+			float gain = s->delta_position.is0()? emitters.gain[h]: fx_volume * distance_model.gain(s_pos.length());
+			lsources.push_back(source_t(s, s_pos, emitters.velocity[h], emitters.direction[h], emitters.velocity[listener->handle], gain));
+			++same_sounds_n;
+			//LOG_DEBUG(("%u: source: %d", (unsigned)lsources.size(), j->first));
 		} else {
 			s->_update_position(n);
 		}
 		++j;
 	}
 
-	if (sset.empty() && o->dead) 
+	if (sset.empty() && (emitters.flags[h] & emitters_type::Dead) != 0) 
 		return false;
 
 	return true;
@@ -87,46 +159,131 @@ bool Context::process_object(Object *o, Sources &sset, std::vector<source_t> &ls
 
 void Context::process(Sint16 *stream, int size) {
 	//TIMESPY(("total"));
+	//audio callback or whoever renders the context by hand, only while it renders
+	rendering_threads[0] = SDL_ThreadID();
+	flush_commands();
 
-	{
-		//TIMESPY(("sorting objects"));
-		std::sort(objects.begin(), objects.end(), Object::DistanceOrder(listener->position));
+	ranked_objects.clear();
+	const v3<float> listener_position = emitters.position[listener->handle];
+	bool culling = grid.enabled() && distance_model.max_distance > 0;
+	if (culling) {
+		float radius = distance_model.max_distance * distance_model.distance_divisor;
+		grid_objects.clear();
+		grid.query(listener_position, radius, grid_objects);
+		for(std::vector<unsigned>::const_iterator i = grid_objects.begin(); i != grid_objects.end(); ++i) {
+			float distance = listener_position.quick_distance(emitters.position[*i]);
+			if (distance <= radius * radius)
+				ranked_objects.push_back(ranked_object(distance, *i));
+		}
+	} else {
+		const v3<float> *position = emitters.position.empty()? NULL: &emitters.position[0];
+		for(size_t h = 0; h < emitters.size(); ++h) {
+			if (emitters.object[h] != NULL)
+				ranked_objects.push_back(ranked_object(listener_position.quick_distance(position[h]), (unsigned)h));
+		}
 	}
-	//LOG_DEBUG(("sorted %u objects", (unsigned)objects.size()));
 	
-	std::vector<source_t> lsources;
+	std::vector<source_t> &lsources = selected_sources;
+	lsources.clear();
 	int n = size / 2 / spec.channels;
 
-	for(objects_type::iterator i = objects.begin(); i != objects.end(); ) {
-		Object *o = *i;
-		//bool _process_object(Object *o, Sources &sset, std::vector<source_t> &lsources, unsigned max_sources, const DistanceModel &distance_model, Object *listener, unsigned n) {
-		bool ok_1 = process_object<Object::NamedSources>(o, o->named_sources, lsources, n),
-			ok_2 = process_object<Object::IndexedSources>(o, o->indexed_sources, lsources, n);
-		if (ok_1 || ok_2) 
-			++i;
-		else {
-			delete o;
-			i = objects.erase(i);
+	//only the nearest objects need to be ordered: sort them chunk by chunk until all source slots are taken.
+	//chunk doubles every time, so many silent objects nearby cost as much as one full sort, not a rescan per chunk
+	size_t sorted = 0, step = max_sources > 0? max_sources: 1;
+	purged_objects.clear();
+	for(size_t i = 0; i < ranked_objects.size(); ++i) {
+		if (i == sorted && lsources.size() < max_sources) {
+			//TIMESPY(("selecting objects"));
+			size_t chunk = sorted + step;
+			step *= 2;
+			if (chunk > ranked_objects.size())
+				chunk = ranked_objects.size();
+			std::partial_sort(ranked_objects.begin() + sorted, ranked_objects.begin() + chunk, ranked_objects.end());
+			for(size_t k = sorted; k < chunk; ++k) {
+				unsigned h = ranked_objects[k].handle;
+				emitters.gain[h] = fx_volume * distance_model.gain((emitters.position[h] - listener_position).length());
+			}
+			sorted = chunk;
+		}
+		
+		unsigned h = ranked_objects[i].handle;
+		if (!visit_object(h, lsources, n, true))
+			purged_objects.push_back(h);
+	}
+	
+	if (culling && !emitters.object.empty()) {
+		for(unsigned i = 0; i < SWEEP_OBJECTS && i < emitters.size(); ++i) {
+			unsigned h = (unsigned)(sweep_position++ % emitters.size());
+			if (emitters.object[h] == NULL || emitters.mix_position[h] == mix_position + n)
+				continue;
+			if (!visit_object(h, lsources, n, false))
+				purged_objects.push_back(h);
 		}
 	}
+	
+	for(size_t i = 0; i < purged_objects.size(); ++i) {
+		unsigned h = purged_objects[i];
+		if (grid.enabled())
+			grid.remove(h, emitters.grid_cell[h]);
+		delete emitters.object[h];
+		emitters.release(h);
+	}
+	mix_position += n;
+	//LOG_DEBUG(("selected %u sources from %u objects", (unsigned)lsources.size(), (unsigned)objects.size()));
 
-	memset(stream, 0, size);
+	unsigned samples = (unsigned)size / 2;
+	mix_bus.resize(samples);
+	std::fill(mix_bus.begin(), mix_bus.end(), 0.0f);
 
 	for(streams_type::iterator i = streams.begin(); i != streams.end();) {
 		//LOG_DEBUG(("processing stream %d", i->first));
 		stream_info &stream_info = i->second;
+		Stream *stream = stream_info.stream;
+		if (stream_info.direct && (stream->sample_rate != spec.freq || stream->format != spec.format))
+			stream_info.direct = false;
+		
+		bool direct = stream_info.direct;
 		while ((int)stream_info.buffer.get_size() < size) {
-			clunk::Buffer data;
-			bool eos = !stream_info.stream->read(data, size);
-			if (!data.empty() && stream_info.stream->sample_rate != spec.freq) {
-				//LOG_DEBUG(("converting audio data from %u to %u", stream_info.stream->sample_rate, spec.freq));
-				convert(data, data, stream_info.stream->sample_rate, stream_info.stream->format, stream_info.stream->channels);
+			bool eos = false;
+			if (direct) {
+				//decoding right into the free space of the ring
+				stream_info.buffer.reserve(size);
+				size_t span;
+				void *dst = stream_info.buffer.get_free_span(span);
+				unsigned written = 0;
+				if (!stream->read_into(dst, (unsigned)span, written, eos)) {
+					stream_info.direct = direct = false;
+					continue;
+				}
+				assert(written <= span);
+				stream_info.buffer.push(written);
+				//no progress, e.g. free span before the wrap is too small for a frame: the rest of the period goes through read()
+				if (written == 0 && !eos)
+					direct = false;
+			} else {
+				clunk::Buffer &data = stream_data;
+				data.set_size(0);
+				eos = !stream->read(data, size);
+				if (!data.empty() && stream->format != spec.format) {
+					//format only, rate is converted by the resampler keeping its state between chunks
+					convert(data, spec.freq, stream->format, stream->channels);
+				}
+				if (!data.empty() && stream->sample_rate != spec.freq) {
+					//LOG_DEBUG(("resampling audio data from %u to %u", stream->sample_rate, spec.freq));
+					Resampler &resampler = stream_info.resampler;
+					if (!resampler.matches(stream->sample_rate, spec.freq, stream->channels))
+						resampler.init(stream->sample_rate, spec.freq, stream->channels, resampler_quality);
+					resampled_data.set_size(0);
+					resampler.process(resampled_data, (const Sint16 *)data.get_ptr(), (unsigned)(data.get_size() / stream->channels / 2));
+					stream_info.buffer.push(resampled_data.get_ptr(), resampled_data.get_size());
+				} else {
+					stream_info.buffer.push(data.get_ptr(), data.get_size());
+				}
+				//LOG_DEBUG(("read %u bytes", (unsigned)data.get_size()));
 			}
-			stream_info.buffer.append(data);
-			//LOG_DEBUG(("read %u bytes", (unsigned)data.get_size()));
 			if (eos) {
 				if (stream_info.loop) {
-					stream_info.stream->rewind();
+					stream->rewind();
 				} else {
 					break;
 				}
@@ -147,65 +304,367 @@ void Context::process(Sint16 *stream, int size) {
 		if (buf_size >= size)
 			buf_size = size;
 
-		int sdl_v = (int)floor(SDL_MIX_MAXVOLUME * stream_info.gain + 0.5f);
-		SDL_MixAudio((Uint8 *)stream, (Uint8 *)stream_info.buffer.get_ptr(), buf_size, sdl_v);
-		
-		if ((int)stream_info.buffer.get_size() > size) {
-			memmove(stream_info.buffer.get_ptr(), ((Uint8 *)stream_info.buffer.get_ptr()) + size, stream_info.buffer.get_size() - size);
-			stream_info.buffer.set_size(stream_info.buffer.get_size() - size);
-		} else {
-			stream_info.buffer.free();
+		//buffered data could wrap around the end of the ring
+		for(size_t offset = 0; offset < (size_t)buf_size; ) {
+			size_t span;
+			const void *data = stream_info.buffer.get_span(offset, span);
+			if (offset + span > (size_t)buf_size)
+				span = buf_size - offset;
+			mix(&mix_bus[offset / 2], (const Sint16 *)data, (unsigned)span / 2, stream_info.gain);
+			offset += span;
 		}
+		stream_info.buffer.pop(size);
 		
 		++i;
 	}
 	
-	clunk::Buffer buf;
-	buf.set_size(size);
+	if (source_buffers.size() < lsources.size())
+		source_buffers.resize(lsources.size());
+	for(unsigned i = 0; i < lsources.size(); ++i) {
+		source_buffers[i].set_size(samples * sizeof(float));
+	}
 	
 	//TIMESPY(("mixing sources"));
 	//LOG_DEBUG(("mixing %u sources", (unsigned)lsources.size()));
+	if (workers.empty() || lsources.size() < 2) {
+		render_sources(lsources, 0, 1, scratch);
+	} else {
+		unsigned step = (unsigned)workers.size() + 1;
+		worker_sources = &lsources;
+		for(unsigned i = 0; i < workers.size(); ++i) {
+			SDL_SemPost(workers[i]->start);
+		}
+		render_sources(lsources, 0, step, scratch);
+		for(unsigned i = 0; i < workers.size(); ++i) {
+			SDL_SemWait(workers_done);
+		}
+		worker_sources = NULL;
+	}
+	
+	//mixing in the sources order, result does not depend on threads. sources are rendered with their volume applied
 	for(unsigned i = 0; i < lsources.size(); ++i ) {
-		const source_t& source_info = lsources[i];
+		//LOG_DEBUG(("%u: mixing source with volume %g", i, lsources[i].volume));
+		if (lsources[i].volume <= 0)
+			continue;
+		
+		mix(&mix_bus[0], (const float *)source_buffers[i].get_ptr(), samples);
+	}
+	
+	clip(stream, &mix_bus[0], samples);
+	
+	if (fdump != NULL) {
+		if (fwrite(stream, size, 1, fdump) != 1) {
+			fclose(fdump);
+			fdump = NULL;
+		}
+	}
+	rendering_threads[0] = 0;
+}
+
+
+void Context::render_sources(std::vector<source_t> &lsources, unsigned first, unsigned step, Source::hrtf_scratch &scratch) {
+	for(unsigned i = first; i < lsources.size(); i += step) {
+		source_t& source_info = lsources[i];
 		Source * source = source_info.source;
+		source_info.volume = 0;
 				
 		float dpitch = 1.0f;
 		if (distance_model.doppler_factor > 0) {
 			dpitch = distance_model.doppler_pitch(-source_info.s_pos, source_info.s_vel, source_info.l_vel);
 		}
 
-		float volume = fx_volume * distance_model.gain(source_info.s_pos.length());
+		float volume = source_info.gain;
 		int sdl_v = (int)floor(SDL_MIX_MAXVOLUME * volume + 0.5f);
 		if (sdl_v <= 0)
 			continue;
-		//check for 0
-		volume = source->_process(buf, spec.channels, source_info.s_pos, source_info.s_dir, volume, dpitch);
-		sdl_v = (int)floor(SDL_MIX_MAXVOLUME * volume + 0.5f);
-		//LOG_DEBUG(("%u: mixing source with volume %g (%d)", i, volume, sdl_v));
-		if (sdl_v <= 0)
-			continue;
-		if (sdl_v > SDL_MIX_MAXVOLUME)
-			sdl_v = SDL_MIX_MAXVOLUME;
 		
-		SDL_MixAudio((Uint8 *)stream, (Uint8 *)buf.get_ptr(), size, sdl_v);
+		TRY {
+			source_info.volume = source->_process((float *)source_buffers[i].get_ptr(), (unsigned)(source_buffers[i].get_size() / sizeof(float) / spec.channels), spec.channels, source_info.s_pos, source_info.s_dir, volume, dpitch, scratch);
+		} CATCH("rendering source", {})
+	}
+}
+
+int Context::worker_main(void *arg) {
+	worker *w = (worker *)arg;
+	Context *self = w->context;
+	self->rendering_threads[w->index] = SDL_ThreadID();
+	while(true) {
+		SDL_SemWait(w->start);
+		if (self->workers_exit)
+			break;
+		self->render_sources(*self->worker_sources, w->index, (unsigned)self->workers.size() + 1, w->scratch);
+		SDL_SemPost(self->workers_done);
+	}
+	return 0;
+}
+
+void Context::stop_workers() {
+	workers_exit = true;
+	for(unsigned i = 0; i < workers.size(); ++i) {
+		SDL_SemPost(workers[i]->start);
+	}
+	for(unsigned i = 0; i < workers.size(); ++i) {
+		worker *w = workers[i];
+		SDL_WaitThread(w->thread, NULL);
+		SDL_DestroySemaphore(w->start);
+		delete w;
 	}
+	workers.clear();
+	workers_exit = false;
+	for(unsigned i = 1; i < MAX_THREADS; ++i)
+		rendering_threads[i] = 0;
 	
-	if (fdump != NULL) {
-		if (fwrite(stream, size, 1, fdump) != 1) {
-			fclose(fdump);
-			fdump = NULL;
+	if (workers_done != NULL) {
+		SDL_DestroySemaphore(workers_done);
+		workers_done = NULL;
+	}
+}
+
+void Context::set_threads(int threads) {
+	AudioLocker l;
+	stop_workers();
+	if (threads <= 1)
+		return;
+	if (threads > (int)MAX_THREADS) {
+		LOG_DEBUG(("%d rendering threads requested, using %u", threads, (unsigned)MAX_THREADS));
+		threads = MAX_THREADS;
+	}
+	
+	workers_done = SDL_CreateSemaphore(0);
+	if (workers_done == NULL)
+		throw_sdl(("SDL_CreateSemaphore"));
+	
+	//threads started so far are stopped if any of them fails, pool is never left half-built
+	try {
+		workers.reserve(threads - 1);
+		for(int i = 1; i < threads; ++i) {
+			worker *w = new worker(this, i);
+			w->start = SDL_CreateSemaphore(0);
+			if (w->start == NULL) {
+				delete w;
+				throw_sdl(("SDL_CreateSemaphore"));
+			}
+			w->thread = SDL_CreateThread(&Context::worker_main, w);
+			if (w->thread == NULL) {
+				SDL_DestroySemaphore(w->start);
+				delete w;
+				throw_sdl(("SDL_CreateThread"));
+			}
+			workers.push_back(w);
+		}
+	} catch(...) {
+		stop_workers();
+		throw;
+	}
+	LOG_DEBUG(("started %u rendering threads", (unsigned)workers.size()));
+}
+
+Context::command * Context::get_command(command::Type type, Object *o) {
+	command *c = commands.back();
+	if (c == NULL) {
+		LOG_DEBUG(("command queue is full, flushing it"));
+		AudioLocker l;
+		flush_commands();
+		c = commands.back();
+		assert(c != NULL);
+	}
+	c->type = type;
+	c->object = o;
+	return c;
+}
+
+void Context::flush_commands() {
+	command *c;
+	while((c = commands.front()) != NULL) {
+		TRY {
+			apply_command(*c);
+		} CATCH("applying command", {})
+		commands.pop();
+	}
+}
+
+void Context::apply_command(const command &c) {
+	Object *o = c.object;
+	switch(c.type) {
+	case command::Transform: 
+		apply_transform(transform(o->handle, c.mask, c.position, c.velocity, c.direction));
+		break;
+	case command::ApplyFrame: {
+			frame_t *f = c.frame;
+			for(std::vector<transform>::const_iterator i = f->transforms.begin(); i != f->transforms.end(); ++i) {
+				apply_transform(*i);
+			}
+			CLUNK_MEMORY_BARRIER();
+			f->busy = false;
 		}
+		break;
+	case command::Play: 
+		if (c.named)
+			o->named_sources.insert(c.index, c.source);
+		else 
+			o->indexed_sources.insert(c.index, c.source);
+		break;
+	case command::Cancel: 
+		o->_cancel(c.named, c.index, c.fadeout);
+		break;
+	case command::FadeOut: 
+		o->_fade_out(c.named, c.index, c.fadeout);
+		break;
+	case command::SetLoop: 
+		o->_set_loop(c.named, c.index, c.loop);
+		break;
+	case command::CancelAll: 
+		o->_cancel_all(c.force, c.fadeout);
+		break;
+	case command::Autodelete: 
+		o->_cancel_all(false, 0.1f);
+		emitters.flags[o->handle] |= emitters_type::Dead;
+		break;
+	}
+}
+
+int Context::get_source_id(const std::string &name) {
+	source_names_type::const_iterator i = source_names.find(name);
+	if (i != source_names.end())
+		return i->second;
+	int id = (int)source_names.size();
+	source_names.insert(source_names_type::value_type(name, id));
+	return id;
+}
+
+int Context::find_source_id(const std::string &name) const {
+	source_names_type::const_iterator i = source_names.find(name);
+	return i != source_names.end()? i->second: -1;
+}
+
+void Context::apply_transform(const transform &t) {
+	unsigned h = t.handle;
+	if (t.mask & transform::Position) {
+		emitters.position[h] = t.position;
+		move_object(h);
+	}
+	if (t.mask & transform::Velocity)
+		emitters.velocity[h] = t.velocity;
+	if (t.mask & transform::Direction)
+		emitters.direction[h] = t.direction;
+}
+
+void Context::set_transform(Object *o, unsigned mask, const v3<float> &position, const v3<float> &velocity, const v3<float> &direction) {
+	if (current_frame != NULL) {
+		current_frame->transforms.push_back(transform(o->handle, mask, position, velocity, direction));
+		return;
 	}
+	
+	command *c = get_command(command::Transform, o);
+	c->mask = mask;
+	c->position = position;
+	c->velocity = velocity;
+	c->direction = direction;
+	push_command();
 }
 
+void Context::begin_frame() {
+	if (current_frame != NULL)
+		return;
+	
+	frame_t *f = frames + next_frame;
+	if (f->busy) {
+		//mixer did not apply this frame yet, apply it right now
+		AudioLocker l;
+		flush_commands();
+	}
+	CLUNK_MEMORY_BARRIER();
+	assert(!f->busy);
+	f->transforms.clear();
+	current_frame = f;
+}
+
+void Context::end_frame() {
+	frame_t *f = current_frame;
+	if (f == NULL)
+		return;
+	current_frame = NULL;
+	next_frame = (next_frame + 1) % FRAMES_SIZE;
+	
+	if (f->transforms.empty())
+		return;
+	
+	f->busy = true;
+	command *c = get_command(command::ApplyFrame, NULL);
+	c->frame = f;
+	push_command();
+}
+
+void Context::update_objects(size_t n, Object * const *objects, const v3<float> *positions, const v3<float> *velocities, const v3<float> *directions) {
+	unsigned mask = 0;
+	if (positions != NULL)
+		mask |= transform::Position;
+	if (velocities != NULL)
+		mask |= transform::Velocity;
+	if (directions != NULL)
+		mask |= transform::Direction;
+	if (n == 0 || mask == 0)
+		return;
+	
+	bool own_frame = current_frame == NULL;
+	if (own_frame)
+		begin_frame();
+	
+	std::vector<transform> &transforms = current_frame->transforms;
+	transforms.reserve(transforms.size() + n);
+	const v3<float> zero;
+	for(size_t i = 0; i < n; ++i) {
+		transforms.push_back(transform(objects[i]->handle, mask, 
+			positions != NULL? positions[i]: zero, 
+			velocities != NULL? velocities[i]: zero, 
+			directions != NULL? directions[i]: zero));
+	}
+	
+	if (own_frame)
+		end_frame();
+}
 
 Object *Context::create_object() {
 	AudioLocker l;
 	Object *o = new Object(this);
-	objects.push_back(o);
+	unsigned h = o->handle = emitters.allocate(o, mix_position);
+	//per-object scratch of the callback grows here, not in process()
+	ranked_objects.reserve(emitters.size());
+	grid_objects.reserve(emitters.size());
+	purged_objects.reserve(emitters.size());
+	grid.reserve((unsigned)emitters.size());
+	if (grid.enabled()) {
+		emitters.grid_cell[h] = grid.get_cell(emitters.position[h]);
+		grid.insert(h, emitters.grid_cell[h]);
+	}
 	return o;
 }
 
+void Context::move_object(unsigned h) {
+	if (!grid.enabled())
+		return;
+	SpatialGrid::cell_type cell = grid.get_cell(emitters.position[h]);
+	if (cell == emitters.grid_cell[h])
+		return;
+	grid.remove(h, emitters.grid_cell[h]);
+	grid.insert(h, cell);
+	emitters.grid_cell[h] = cell;
+}
+
+void Context::set_spatial_index(float cell_size) {
+	AudioLocker l;
+	grid.reset(cell_size);
+	if (!grid.enabled())
+		return;
+	grid.reserve((unsigned)emitters.size());
+	for(size_t h = 0; h < emitters.size(); ++h) {
+		if (emitters.object[h] == NULL)
+			continue;
+		emitters.grid_cell[h] = grid.get_cell(emitters.position[h]);
+		grid.insert((unsigned)h, emitters.grid_cell[h]);
+	}
+}
+
 Sample *Context::create_sample() {
 	AudioLocker l;
 	return new Sample(this);
@@ -248,25 +707,52 @@ void Context::init(const int sample_rate, const Uint8 channels, int period_size)
 		LOG_ERROR(("Could not operate on %d channels", spec.channels));
 
 	LOG_DEBUG(("opened audio device, sample rate: %d, period: %d, channels: %d", spec.freq, spec.samples, spec.channels));
+	cpu_features::detect();
+	LOG_DEBUG(("cpu features:%s%s%s", cpu_features::has(cpu_features::SSE2)? " sse2": "", cpu_features::has(cpu_features::AVX)? " avx": "", 
+		cpu_features::has(cpu_features::AVX512F)? " avx512f": ""));
+	Source::_init_tables();
+	AudioLocker l;
+	if (Buffer::allocation_hook == NULL || Buffer::allocation_hook == &count_allocation) {
+		Buffer::allocation_hook = &count_allocation;
+		counting_context = this;
+	}
+	reserve_buffers();
 	SDL_PauseAudio(0);
 	
-	AudioLocker l;
 	listener = create_object();
 }
 
 void Context::delete_object(Object *o) {
+	if (current_frame != NULL) {
+		//object deleted in the middle of the frame, drop its transforms
+		std::vector<transform> &transforms = current_frame->transforms;
+		size_t n = 0;
+		for(size_t i = 0; i < transforms.size(); ++i) {
+			if (transforms[i].handle != o->handle)
+				transforms[n++] = transforms[i];
+		}
+		transforms.erase(transforms.begin() + n, transforms.end());
+	}
+	
 	AudioLocker l;
-	objects_type::iterator i = std::find(objects.begin(), objects.end(), o);
-	while(i != objects.end() && *i == o)
-		i = objects.erase(i); //just for fun
+	if (grid.enabled())
+		grid.remove(o->handle, emitters.grid_cell[o->handle]);
+	emitters.release(o->handle);
 }
 
 void Context::deinit() {
 	//cleanup objects here too.
-	if (!SDL_WasInit(SDL_INIT_AUDIO))
+	if (!SDL_WasInit(SDL_INIT_AUDIO)) {
+		stop_workers();
 		return;
+	}
 	
 	AudioLocker l;
+	stop_workers();
+	flush_commands();
+	if (counting_context == this)
+		counting_context = NULL;
+	rendering_threads[0] = 0;
 	delete listener;
 	listener = NULL;
 	SDL_CloseAudio();
@@ -294,7 +780,10 @@ void Context::play(const int id, Stream *stream, bool loop) {
 	stream_info.stream = stream;
 	stream_info.loop = loop;
 	stream_info.paused = false;
+	stream_info.direct = true;
 	stream_info.gain = 1.0f;
+	if (stream != NULL && stream->sample_rate != spec.freq && stream->channels > 0)
+		stream_info.resampler.init(stream->sample_rate, spec.freq, stream->channels, resampler_quality);
 }
 
 bool Context::playing(const int id) const {
@@ -326,6 +815,11 @@ void Context::stop(const int id) {
 	streams.erase(i);
 }
 
+void Context::set_resampler_quality(Resampler::Quality quality) {
+	AudioLocker l;
+	resampler_quality = quality;
+}
+
 void Context::set_volume(const int id, float volume) {
 	if (volume < 0)
 		volume = 0;
@@ -359,25 +853,49 @@ void Context::stop_all() {
 void Context::set_max_sources(int sources) {
 	AudioLocker l;
 	max_sources = sources;
+	reserve_buffers();
+}
+
+void Context::reserve_buffers() {
+	size_t samples = (size_t)spec.samples * spec.channels;
+	if (samples == 0)
+		return;
+	
+	selected_sources.reserve(max_sources);
+	if (source_buffers.size() < max_sources)
+		source_buffers.resize(max_sources);
+	for(size_t i = 0; i < source_buffers.size(); ++i) {
+		source_buffers[i].set_capacity(samples * sizeof(float));
+	}
+	mix_bus.reserve(samples);
+	stream_data.set_capacity(samples * 2);
 }
 
 void Context::convert(clunk::Buffer &dst, const clunk::Buffer &src, int rate, const Uint16 format, const Uint8 channels) {
+	if (&dst != &src)
+		dst = src;
+	convert(dst, rate, format, channels);
+}
+
+void Context::convert(clunk::Buffer &data, int rate, const Uint16 format, const Uint8 channels) {
 	SDL_AudioCVT cvt;
 	memset(&cvt, 0, sizeof(cvt));
 	if (SDL_BuildAudioCVT(&cvt, format, channels, rate, spec.format, channels, spec.freq) == -1) {
 		throw_sdl(("DL_BuildAudioCVT(%d, %04x, %u)", rate, format, channels));
 	}
-	size_t buf_size = (size_t)(src.get_size() * cvt.len_mult);
-	cvt.buf = (Uint8 *)malloc(buf_size);
-	cvt.len = (int)src.get_size();
-
-	assert(buf_size >= src.get_size());
-	memcpy(cvt.buf, src.get_ptr(), src.get_size());
+	size_t src_size = data.get_size();
+	size_t buf_size = (size_t)(src_size * cvt.len_mult);
+	assert(buf_size >= src_size);
+	
+	//conversion is done in place, it needs len_mult times more memory
+	data.set_capacity(buf_size);
+	cvt.buf = (Uint8 *)data.get_ptr();
+	cvt.len = (int)src_size;
 
 	if (SDL_ConvertAudio(&cvt) == -1) 
 		throw_sdl(("SDL_ConvertAudio"));
 
-	dst.set_data(cvt.buf, (size_t)(cvt.len * cvt.len_ratio), true);
+	data.set_size((size_t)(cvt.len * cvt.len_ratio));
 }
 
 /*!
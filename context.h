@@ -21,16 +21,20 @@
 #define CLUNK_CONTEXT_H__
 
 #include <map>
-#include <deque>
 #include <vector>
 #include <stdio.h>
 #include <SDL_audio.h>
+#include <SDL_thread.h>
 
 #include "export_clunk.h"
 #include "object.h"
 #include "sample.h"
 #include "buffer.h"
 #include "distance_model.h"
+#include "source.h"
+#include "spatial_grid.h"
+#include "command_queue.h"
+#include "resampler.h"
 
 namespace clunk {
 
@@ -60,6 +64,22 @@ public:
 	*/
 	void set_max_sources(int sources);
 	
+	/*!
+		\brief Sets number of threads rendering 3d sources. 
+		Sources are spread across threads, audio callback thread renders its share too. 
+		Mixing order does not depend on the threads number.
+		\param[in] threads number of rendering threads, 1 (default) disables worker threads, at most 32 threads are used.
+	*/
+	void set_threads(int threads);
+	
+	/*!
+		\brief Enables culling of the distant objects with the uniform grid. 
+		Objects farther than max_distance of the distance model are not processed at all, their sources are fast-forwarded 
+		when they come back into the range. Useful for the clamped distance models with the zero gain at max_distance.
+		\param[in] cell_size size of the grid cell, max_distance is a good start. 0 disables culling.
+	*/
+	void set_spatial_index(float cell_size);
+	
 	//saves raw stream into file. use save(std::string()) to stop this madness.
 	void save(const std::string &file);
 
@@ -68,6 +88,25 @@ public:
 
 	///creates new clunk::Object
 	Object *create_object();
+	
+	/*!
+		\brief starts new frame of objects' transforms. 
+		Positions, velocities and directions set until end_frame() are published at once, 
+		mixer never sees the frame partially applied.
+	*/
+	void begin_frame();
+	///publishes transforms set since begin_frame()
+	void end_frame();
+	/*!
+		\brief updates transforms of many objects at once
+		\param[in] n number of objects
+		\param[in] objects objects to update
+		\param[in] positions new positions or NULL to keep them
+		\param[in] velocities new velocities or NULL to keep them
+		\param[in] directions new directions or NULL to keep them
+		All changes are published as a single frame (or added to the current one).
+	*/
+	void update_objects(size_t n, Object * const *objects, const v3<float> *positions, const v3<float> *velocities, const v3<float> *directions);
 
 	///creates clunk::Sample 
 	Sample *create_sample();
@@ -83,6 +122,20 @@ public:
 		return spec;
 	}
 	
+	/*!
+		\brief returns number of clunk::Buffer and RingBuffer allocations made by the threads rendering this context
+		Debugging aid: buffers are preallocated in init(), so counter must not grow after the first periods. 
+		Audio callback and worker threads are counted, streams growing their buffers in read() are counted too. 
+		Only clunk buffers are seen, use is_rendering_thread() in the replaced operator new to count the rest.
+	*/
+	unsigned get_buffer_allocations() const;
+	
+	/*!
+		\brief returns true if called from the audio callback or from one of the worker threads of this context
+		Debugging aid: replaced operator new could use it to check that rendering does not allocate.
+	*/
+	bool is_rendering_thread() const;
+	
 	///internal: NEVER USE IT !
 	/*!
 		\internal generate next 'len' bytes
@@ -107,6 +160,12 @@ public:
 		\param[in] volume volume (0.0 - 1.0)
 	*/
 	void set_volume(int id, float volume);
+	/*!
+		\brief sets quality of the sample rate conversion of the streams
+		Applies to the streams started after the call. Default is clunk::Resampler::Medium.
+		\param[in] quality resampler quality
+	*/
+	void set_resampler_quality(Resampler::Quality quality);
 	
 	/*! 
 		\brief sets volume of the generated sound
@@ -141,20 +200,166 @@ private:
 
 	static void callback(void *userdata, Uint8 *stream, int len);
 	void delete_object(Object *o);
+	//updates object's cell in the spatial grid, called by object after position change
+	void move_object(unsigned handle);
 
+	friend class Object;
 	friend clunk::Object::~Object();
+	
+	//object's position, velocity and/or direction change
+	struct transform {
+		enum { Position = 1, Velocity = 2, Direction = 4, All = 7 };
+		unsigned handle;
+		unsigned mask;
+		v3<float> position, velocity, direction;
+		
+		inline transform(unsigned handle, unsigned mask, const v3<float> &position, const v3<float> &velocity, const v3<float> &direction) : 
+			handle(handle), mask(mask), position(position), velocity(velocity), direction(direction) {}
+	};
+	
+	//transforms of the whole frame, filled by the game thread and applied by the audio thread at once
+	struct frame_t {
+		std::vector<transform> transforms;
+		//published, but not applied yet
+		volatile bool busy;
+		
+		frame_t() : busy(false) {}
+	};
+	enum { FRAMES_SIZE = 3 };
+	frame_t frames[FRAMES_SIZE];
+	//frame being filled, NULL outside of begin_frame/end_frame
+	frame_t *current_frame;
+	unsigned next_frame;
+	
+	//sets object's transform, queues it or adds it to the current frame
+	void set_transform(Object *o, unsigned mask, const v3<float> &position, const v3<float> &velocity, const v3<float> &direction);
+	void apply_transform(const transform &t);
+
+	//deferred object change, queued by the game thread and applied by the audio thread
+	struct command {
+		enum Type { Transform, ApplyFrame, Play, Cancel, FadeOut, SetLoop, CancelAll, Autodelete };
+		Type type;
+		Object *object;
+		
+		unsigned mask;
+		v3<float> position, velocity, direction;
+		frame_t *frame;
+		
+		//index is id of the interned name if named is set
+		bool named;
+		int index;
+		Source *source;
+		float fadeout;
+		bool loop, force;
+		
+		command() : type(Transform), object(NULL), mask(0), frame(NULL), named(false), index(0), source(NULL), fadeout(0), loop(false), force(false) {}
+		inline void set_name(int id) { named = true; index = id; }
+		inline void set_index(int i) { named = false; index = i; }
+	};
+	
+	enum { COMMANDS_SIZE = 2048 };
+	command_queue<command, COMMANDS_SIZE> commands;
+	
+	//returns free command, if queue is full, applies queued commands with audio locked
+	command * get_command(command::Type type, Object *o);
+	inline void push_command() { commands.push(); }
+	//applies all queued commands, must be called from the audio callback or with audio locked
+	void flush_commands();
+	void apply_command(const command &c);
+	
+	//names of the sources interned to integer ids, used from the objects' producer thread only
+	typedef std::map<const std::string, int> source_names_type;
+	source_names_type source_names;
+	//returns id of the given name, registers new one if needed
+	int get_source_id(const std::string &name);
+	//returns id of the given name or -1 if it was never used
+	int find_source_id(const std::string &name) const;
 	friend clunk::Sample::~Sample();
 	
-	typedef std::deque<Object *> objects_type;
-	objects_type objects;
+	//objects' state stored by columns, indexed by Object::handle. free handles have NULL object.
+	struct emitters_type {
+		enum { Dead = 1 };
+		
+		std::vector<Object *> object;
+		std::vector<v3<float> > position, velocity, direction;
+		//distance gain of the object's center with fx volume applied, valid for the objects selected in the current period
+		std::vector<float> gain;
+		//cell of the spatial grid holding the object
+		std::vector<v3<int> > grid_cell;
+		//mixing position the object was last processed at
+		std::vector<unsigned> mix_position;
+		std::vector<unsigned char> flags;
+		std::vector<unsigned> free_handles;
+		
+		inline size_t size() const { return object.size(); }
+		
+		unsigned allocate(Object *o, unsigned mix_position) {
+			unsigned h;
+			if (!free_handles.empty()) {
+				h = free_handles.back();
+				free_handles.pop_back();
+			} else {
+				h = (unsigned)object.size();
+				object.push_back(NULL);
+				position.push_back(v3<float>());
+				velocity.push_back(v3<float>());
+				direction.push_back(v3<float>());
+				gain.push_back(0);
+				grid_cell.push_back(v3<int>());
+				this->mix_position.push_back(0);
+				flags.push_back(0);
+			}
+			object[h] = o;
+			position[h].clear();
+			velocity[h].clear();
+			direction[h].clear();
+			gain[h] = 0;
+			grid_cell[h].clear();
+			this->mix_position[h] = mix_position;
+			flags[h] = 0;
+			return h;
+		}
+		
+		inline void release(unsigned h) {
+			object[h] = NULL;
+			free_handles.push_back(h);
+		}
+	};
+	emitters_type emitters;
+	
+	struct ranked_object {
+		float distance;
+		unsigned handle;
+		
+		inline ranked_object(float distance, unsigned handle) : distance(distance), handle(handle) {}
+		inline bool operator<(const ranked_object &other) const {
+			return distance < other.distance;
+		}
+	};
+	//objects with squared distances to the listener, reused between periods
+	std::vector<ranked_object> ranked_objects;
+	
+	SpatialGrid grid;
+	std::vector<unsigned> grid_objects;
+	//culled objects checked every period to fast-forward and purge their sources
+	enum { SWEEP_OBJECTS = 32 };
+	size_t sweep_position;
+	std::vector<unsigned> purged_objects;
+	
+	//number of frames mixed so far
+	unsigned mix_position;
 	
 	struct stream_info {
-		stream_info() : stream(NULL), loop(false), gain(1.0f), paused(false), buffer() {}
+		stream_info() : stream(NULL), loop(false), gain(1.0f), paused(false), direct(true), buffer() {}
 		Stream *stream;
 		bool loop;
 		float gain;
 		bool paused;
-		clunk::Buffer buffer;
+		//stream reads right into the buffer
+		bool direct;
+		//converts stream's sample rate to the context's one
+		Resampler resampler;
+		clunk::RingBuffer buffer;
 	};
 	
 	typedef std::map<const int, stream_info> streams_type;
@@ -167,6 +372,9 @@ private:
 	DistanceModel distance_model;
 	
 	FILE * fdump;
+	
+	//convolution scratch state used while rendering sources from the callback thread
+	Source::hrtf_scratch scratch;
 
 	struct source_t {
 		Source *source;
@@ -175,12 +383,60 @@ private:
 		v3<float> s_vel;
 		v3<float> s_dir;
 		v3<float> l_vel;
+		
+		float gain, volume;
 
-		inline source_t(Source *source, const v3<float> &s_pos, const v3<float> &s_vel, const v3<float>& s_dir, const v3<float>& l_vel) : 
-		source(source), s_pos(s_pos), s_vel(s_vel), s_dir(s_dir), l_vel(l_vel) {}
+		inline source_t(Source *source, const v3<float> &s_pos, const v3<float> &s_vel, const v3<float>& s_dir, const v3<float>& l_vel, float gain) : 
+		source(source), s_pos(s_pos), s_vel(s_vel), s_dir(s_dir), l_vel(l_vel), gain(gain), volume(0) {}
 	};
 	template<class Sources>
-	bool process_object(Object *o, Sources &sset, std::vector<source_t> &lsources, unsigned n);
+	bool process_object(unsigned h, Sources &sset, std::vector<source_t> &lsources, unsigned n, bool audible);
+	//fast-forwards object's sources if it was skipped and picks audible ones. returns false if object must be deleted
+	bool visit_object(unsigned h, std::vector<source_t> &lsources, unsigned n, bool audible);
+	
+	//renders every 'step'-th source starting from 'first' into its own buffer
+	void render_sources(std::vector<source_t> &lsources, unsigned first, unsigned step, Source::hrtf_scratch &scratch);
+	
+	struct worker {
+		Context *context;
+		unsigned index;
+		SDL_Thread *thread;
+		SDL_sem *start;
+		Source::hrtf_scratch scratch;
+		
+		worker(Context *context, unsigned index) : context(context), index(index), thread(NULL), start(NULL) {}
+	};
+	static int worker_main(void *arg);
+	void stop_workers();
+	
+	//thread ids rendering audio: callback thread first, then workers by index. 0 if not running
+	enum { MAX_THREADS = 32 };
+	Uint32 rendering_threads[MAX_THREADS];
+	volatile unsigned buffer_allocations;
+	static void count_allocation(size_t size);
+	
+	std::vector<worker *> workers;
+	SDL_sem *workers_done;
+	bool workers_exit;
+	//sources being rendered by workers, valid between start and done
+	std::vector<source_t> *worker_sources;
+	//rendered float samples with the volume applied, one buffer per source. clip() is the only place quantizing them
+	std::vector<clunk::Buffer> source_buffers;
+	//sources selected for the current period
+	std::vector<source_t> selected_sources;
+	//data read from the streams and resampled one
+	clunk::Buffer stream_data, resampled_data;
+	Resampler::Quality resampler_quality;
+	//preallocates everything used by process() for the current spec and sources limit
+	void reserve_buffers();
+	//converts audio data in its own memory
+	void convert(clunk::Buffer &data, int rate, const Uint16 format, const Uint8 channels);
+	
+	//streams and sources are accumulated here, then clipped once into the output
+	std::vector<float> mix_bus;
+	static void mix(float *dst, const Sint16 *src, unsigned n, float gain);
+	static void mix(float *dst, const float *src, unsigned n);
+	static void clip(Sint16 *dst, const float *src, unsigned n);
 };
 }
 
@@ -0,0 +1,84 @@
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "cpu_features.h"
+
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64)
+#	include <intrin.h>
+#	define CLUNK_HAS_CPUID
+
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+	int r[4];
+	__cpuidex(r, (int)leaf, (int)subleaf);
+	for(int i = 0; i < 4; ++i)
+		regs[i] = (unsigned)r[i];
+}
+
+static unsigned xgetbv() {
+	return (unsigned)_xgetbv(0);
+}
+
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+#	include <cpuid.h>
+#	define CLUNK_HAS_CPUID
+
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+}
+
+static unsigned xgetbv() {
+	//only lower half of xcr0 is needed
+	unsigned eax, edx;
+	__asm__ __volatile__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
+}
+#endif
+
+using namespace clunk;
+
+unsigned cpu_features::features = 0;
+
+unsigned cpu_features::detect() {
+	unsigned r = 0;
+#ifdef CLUNK_HAS_CPUID
+	unsigned regs[4]; //eax, ebx, ecx, edx
+	cpuid(0, 0, regs);
+	const unsigned max_leaf = regs[0];
+	if (max_leaf < 1)
+		return features = 0;
+
+	cpuid(1, 0, regs);
+	if (regs[3] & (1u << 26))
+		r |= SSE2;
+	
+	//ymm/zmm registers could be used only if OS saves them on context switch
+	const bool osxsave = (regs[2] & (1u << 27)) != 0;
+	const unsigned xcr0 = osxsave? xgetbv(): 0;
+	const bool os_ymm = (xcr0 & 0x06) == 0x06, os_zmm = (xcr0 & 0xe6) == 0xe6;
+	
+	if (os_ymm && (regs[2] & (1u << 28)))
+		r |= AVX;
+	
+	if (max_leaf >= 7) {
+		cpuid(7, 0, regs);
+		if (os_zmm && (regs[1] & (1u << 16)))
+			r |= AVX512F;
+	}
+#endif
+	return features = r;
+}
@@ -0,0 +1,60 @@
+#ifndef CLUNK_CPU_FEATURES_H__
+#define CLUNK_CPU_FEATURES_H__
+
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "export_clunk.h"
+
+namespace clunk {
+
+/*!
+	\brief Instruction set extensions of the current cpu
+	SIMD kernels are compiled in when the compiler supports them (CLUNK_USES_SSE) and chosen at runtime with has(). 
+	CLUNK_USES_SSE is defined for the library sources only, so kernels live in .cpp files and public classes never depend on it.
+	Features are detected by Context::init, before it no extensions are reported and scalar code is used.
+*/
+struct CLUNKAPI cpu_features {
+	enum { 
+		SSE2 = 1, 
+		AVX = 2, 
+		AVX512F = 4 
+	};
+	
+	//! detects features with cpuid, also checks if the OS saves extended registers
+	static unsigned detect();
+	//! returns true if all given features are available
+	static inline bool has(unsigned mask) { return (features & mask) == mask; }
+	//! detected features mask, could be lowered by hand to force slower code paths
+	static unsigned features;
+};
+
+}
+
+#ifdef CLUNK_USES_SSE
+//wider kernels are compiled for their instruction set function by function, and called only if has() reports it
+#	if defined __GNUC__
+#		define CLUNK_USES_AVX
+#		define CLUNK_TARGET(isa) __attribute__((target(isa)))
+#	elif defined _MSC_VER
+#		define CLUNK_USES_AVX
+#		define CLUNK_TARGET(isa)
+#	endif
+#endif
+
+#endif
@@ -29,4 +29,9 @@
 #	define CLUNKAPI DLLIMPORT
 #endif
 
+// Move semantics, msvc reports __cplusplus as 199711L unless /Zc:__cplusplus is given, but has rvalue references since 2010
+#if !defined CLUNK_HAS_RVALUE_REFS && (__cplusplus >= 201103L || (defined _MSC_VER && _MSC_VER >= 1600))
+#	define CLUNK_HAS_RVALUE_REFS
+#endif
+
 #endif
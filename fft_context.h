@@ -10,99 +10,246 @@
 
 namespace clunk {
 
-template<int N, typename T>
-struct danielson_lanczos {
-	typedef danielson_lanczos<N / 2, T> next_type;
+/*!
+	radix-4 decimation in time transform, odd number of bits is handled with additional radix-2 pass.
+	bit-reverse permutation and twiddles of all passes are precalculated and shared between all transforms of the same size
+*/
+template<int BITS, typename T>
+class fft_core {
+public: 
+	enum { N = 1 << BITS };
 
+	static const fft_core & get_shared() {
+		static const fft_core shared;
+		return shared;
+	}
 
-	template<int SIGN>
-	static void apply(std::complex<T>* data) {
-		next_type::template apply<SIGN>(data);
-		next_type::template apply<SIGN>(data + N / 2);
-		
-		T a = (T)(-2 * M_PI / N * SIGN);
-		T wtemp = sin(a / 2);
+	fft_core() : swaps(0) {
+		for(unsigned i = 0; i < N; ++i) {
+			unsigned r = 0;
+			for(int b = 0; b < BITS; ++b) {
+				if (i & (1 << b))
+					r |= 1 << (BITS - 1 - b);
+			}
+			if (i < r) {
+				swap_a[swaps] = i;
+				swap_b[swaps] = r;
+				++swaps;
+			}
+		}
 		
-		std::complex<T> wp(-2 * wtemp * wtemp, sin(a)), w(1, 0);
-
-		for (unsigned i = 0; i < N / 2 ; ++i) {
-			int j = i + N / 2;
-
-			std::complex<T> temp = data[j] * w;
-
-			data[j] = data[i] - temp;
-			data[i] += temp;
-
-			w += w * wp;
+		//w^k, w^2k, w^3k for every butterfly of every radix-4 pass
+		unsigned n = 0;
+		for(unsigned l = (BITS & 1)? 8: 16; l <= N; l <<= 2) {
+			for(unsigned k = 0; k < l / 4; ++k) {
+				for(unsigned r = 1; r <= 3; ++r) {
+					double a = -2 * M_PI * r * k / l;
+					twiddle_re[n] = (T)cos(a);
+					twiddle_im[n] = (T)sin(a);
+					++n;
+				}
+			}
 		}
 	}
-};
-
-
-template<typename T>
-struct danielson_lanczos<8, T> {
-	typedef danielson_lanczos<4, T> next_type;
 
-	static inline void rotate(std::complex<T>* data, int i, const std::complex<T>& w) {
-		int j = i + 4;
-
-		std::complex<T> temp = data[j] * w;
+	//bit-reverse permutation of the input
+	void permute(std::complex<T> *data) const {
+		for(unsigned i = 0; i < swaps; ++i) {
+			std::swap(data[swap_a[i]], data[swap_b[i]]);
+		}
+	}
 
-		data[j] = data[i] - temp;
-		data[i] += temp;
+	void permute(T *re, T *im) const {
+		for(unsigned i = 0; i < swaps; ++i) {
+			std::swap(re[swap_a[i]], re[swap_b[i]]);
+			std::swap(im[swap_a[i]], im[swap_b[i]]);
+		}
 	}
 
+	//SIGN = 1 for the forward transform, -1 for the inverse one. result is not scaled.
 	template<int SIGN>
-	static inline void apply(std::complex<T>* data) {
-		next_type::template apply<SIGN>(data);
-		next_type::template apply<SIGN>(data + 4);
+	void apply(std::complex<T> *data) const {
+		permute(data);
+		
+		T *d = reinterpret_cast<T *>(data);
+		unsigned l;
+		if (BITS & 1) {
+			for(unsigned i = 0; i < 2 * N; i += 4) {
+				butterfly2(d + i, d + i + 2);
+			}
+			l = 8;
+		} else {
+			//first radix-4 pass has no twiddles
+			for(unsigned i = 0; i + 3 < N; i += 4) {
+				butterfly4<SIGN>(d + 2 * i, 2);
+			}
+			l = 16;
+		}
 		
-		rotate(data, 0, std::complex<T>(1, 0));
-		rotate(data, 1, std::complex<T>(M_SQRT1_2, -M_SQRT1_2 * SIGN));
-		rotate(data, 2, std::complex<T>(0, -1));
-		rotate(data, 3, std::complex<T>(-M_SQRT1_2, -M_SQRT1_2 * SIGN));
+		const T *w_re = twiddle_re, *w_im = twiddle_im;
+		for(; l <= N; l <<= 2) {
+			const unsigned l4 = l / 4;
+			for(unsigned base = 0; base < N; base += l) {
+				T *b = d + 2 * base;
+				for(unsigned k = 0; k < l4; ++k) {
+					T *x0 = b + 2 * k, *x1 = x0 + 2 * l4, *x2 = x1 + 2 * l4, *x3 = x2 + 2 * l4;
+					//x1 holds odd-even quarter, x2 holds even-odd one
+					rotate<SIGN>(x2, w_re[3 * k], w_im[3 * k]);
+					rotate<SIGN>(x1, w_re[3 * k + 1], w_im[3 * k + 1]);
+					rotate<SIGN>(x3, w_re[3 * k + 2], w_im[3 * k + 2]);
+					butterfly4<SIGN>(x0, 2 * l4);
+				}
+			}
+			w_re += 3 * l4;
+			w_im += 3 * l4;
+		}
 	}
-};
 
+	/*! 
+		K transforms at once, one per lane: element i of the transform k is at re[i * K + k], im[i * K + k]. 
+		lanes are independent, so the inner loops are vectorized over them.
+	*/
+	template<int SIGN, int K>
+	void apply_batch(T *re, T *im) const {
+		for(unsigned i = 0; i < swaps; ++i) {
+			T *a_re = re + swap_a[i] * K, *a_im = im + swap_a[i] * K, *b_re = re + swap_b[i] * K, *b_im = im + swap_b[i] * K;
+			for(int k = 0; k < K; ++k) {
+				std::swap(a_re[k], b_re[k]);
+				std::swap(a_im[k], b_im[k]);
+			}
+		}
+		
+		unsigned l;
+		if (BITS & 1) {
+			for(unsigned i = 0; i < N; i += 2) {
+				butterfly2_batch<K>(re + i * K, im + i * K);
+			}
+			l = 8;
+		} else {
+			for(unsigned i = 0; i + 3 < N; i += 4) {
+				butterfly4_batch<SIGN, K>(re + i * K, im + i * K, K);
+			}
+			l = 16;
+		}
+		
+		const T *w_re = twiddle_re, *w_im = twiddle_im;
+		for(; l <= N; l <<= 2) {
+			const unsigned l4 = l / 4;
+			for(unsigned base = 0; base < N; base += l) {
+				for(unsigned k = 0; k < l4; ++k) {
+					const unsigned i = (base + k) * K, stride = l4 * K;
+					rotate_batch<SIGN, K>(re + i + 2 * stride, im + i + 2 * stride, w_re[3 * k], w_im[3 * k]);
+					rotate_batch<SIGN, K>(re + i + stride, im + i + stride, w_re[3 * k + 1], w_im[3 * k + 1]);
+					rotate_batch<SIGN, K>(re + i + 3 * stride, im + i + 3 * stride, w_re[3 * k + 2], w_im[3 * k + 2]);
+					butterfly4_batch<SIGN, K>(re + i, im + i, stride);
+				}
+			}
+			w_re += 3 * l4;
+			w_im += 3 * l4;
+		}
+	}
 
-template<typename T>
-struct danielson_lanczos<4, T> {
-	typedef danielson_lanczos<2, T> next_type;
+	///number of the bit-reverse swaps, rows swap_a()[i] and swap_b()[i] are exchanged
+	inline unsigned get_swaps() const { return swaps; }
+	inline const unsigned * get_swap_a() const { return swap_a; }
+	inline const unsigned * get_swap_b() const { return swap_b; }
 
-	template<int SIGN>
-	static inline void apply(std::complex<T>* data) {
-		next_type::template apply<SIGN>(data);
-		next_type::template apply<SIGN>(data + 2);
-		
-		std::complex<T> temp = data[2];
-		data[2] = data[0] - temp;
-		data[0] += temp;
+	/*! 
+		twiddles of the radix-4 passes laid out for the simd kernels of apply_batch: 
+		for every pass, w^k, w^2k and w^3k rows of l/4 values each, every value repeated K times. 
+		adjacent butterflies of the pass read adjacent twiddles, dst_re and dst_im hold N * K values
+	*/
+	template<int K>
+	void expand_twiddles(T *dst_re, T *dst_im) const {
+		const T *w_re = twiddle_re, *w_im = twiddle_im;
+		for(unsigned l = (BITS & 1)? 8: 16; l <= N; l <<= 2) {
+			const unsigned l4 = l / 4;
+			for(unsigned r = 0; r < 3; ++r) {
+				for(unsigned k = 0; k < l4; ++k) {
+					for(int i = 0; i < K; ++i) {
+						*dst_re++ = w_re[3 * k + r];
+						*dst_im++ = w_im[3 * k + r];
+					}
+				}
+			}
+			w_re += 3 * l4;
+			w_im += 3 * l4;
+		}
+	}
 
-		temp = data[3] * std::complex<T>(0, -SIGN);
-		data[3] = data[1] - temp;
-		data[1] += temp;
+private: 
+	template<int SIGN, int K>
+	static inline void rotate_batch(T *x_re, T *x_im, T w_re, T w_im) {
+		for(int k = 0; k < K; ++k) {
+			T re = x_re[k] * w_re - x_im[k] * w_im * SIGN, im = x_im[k] * w_re + x_re[k] * w_im * SIGN;
+			x_re[k] = re;
+			x_im[k] = im;
+		}
 	}
-};
 
+	template<int K>
+	static inline void butterfly2_batch(T *x_re, T *x_im) {
+		for(int k = 0; k < K; ++k) {
+			T re = x_re[K + k], im = x_im[K + k];
+			x_re[K + k] = x_re[k] - re;
+			x_im[K + k] = x_im[k] - im;
+			x_re[k] += re;
+			x_im[k] += im;
+		}
+	}
 
-template<typename T>
-struct danielson_lanczos<2, T> {
-	template<int SIGN>
-	static inline void apply(std::complex<T>* data) {
-		std::complex<T> temp = data[1];
+	template<int SIGN, int K>
+	static inline void butterfly4_batch(T *x_re, T *x_im, unsigned stride) {
+		T *x1_re = x_re + stride, *x2_re = x1_re + stride, *x3_re = x2_re + stride;
+		T *x1_im = x_im + stride, *x2_im = x1_im + stride, *x3_im = x2_im + stride;
+		for(int k = 0; k < K; ++k) {
+			T t0_re = x_re[k] + x1_re[k], t0_im = x_im[k] + x1_im[k];
+			T t1_re = x_re[k] - x1_re[k], t1_im = x_im[k] - x1_im[k];
+			T t2_re = x2_re[k] + x3_re[k], t2_im = x2_im[k] + x3_im[k];
+			T t3_re = (x2_im[k] - x3_im[k]) * SIGN, t3_im = (x3_re[k] - x2_re[k]) * SIGN;
 
-		data[1] = data[0] - temp;
-		data[0] += temp;
+			x_re[k] = t0_re + t2_re; x_im[k] = t0_im + t2_im;
+			x2_re[k] = t0_re - t2_re; x2_im[k] = t0_im - t2_im;
+			x1_re[k] = t1_re + t3_re; x1_im[k] = t1_im + t3_im;
+			x3_re[k] = t1_re - t3_re; x3_im[k] = t1_im - t3_im;
+		}
 	}
-};
 
+	template<int SIGN>
+	static inline void rotate(T *x, T w_re, T w_im) {
+		T re = x[0] * w_re - x[1] * w_im * SIGN, im = x[1] * w_re + x[0] * w_im * SIGN;
+		x[0] = re;
+		x[1] = im;
+	}
+	
+	static inline void butterfly2(T *x0, T *x1) {
+		T re = x1[0], im = x1[1];
+		x1[0] = x0[0] - re;
+		x1[1] = x0[1] - im;
+		x0[0] += re;
+		x0[1] += im;
+	}
 
-template<typename T>
-struct danielson_lanczos<1, T> {
+	//x0 + k * stride, k = 0..3 are already rotated quarters in bit-reversed order
 	template<int SIGN>
-	static inline void apply(std::complex<T>*) {}
-};
+	static inline void butterfly4(T *x0, unsigned stride) {
+		T *x1 = x0 + stride, *x2 = x1 + stride, *x3 = x2 + stride;
+		T t0_re = x0[0] + x1[0], t0_im = x0[1] + x1[1];
+		T t1_re = x0[0] - x1[0], t1_im = x0[1] - x1[1];
+		T t2_re = x2[0] + x3[0], t2_im = x2[1] + x3[1];
+		//(x2 - x3) * -i * SIGN
+		T t3_re = (x2[1] - x3[1]) * SIGN, t3_im = (x3[0] - x2[0]) * SIGN;
+		
+		x0[0] = t0_re + t2_re; x0[1] = t0_im + t2_im;
+		x2[0] = t0_re - t2_re; x2[1] = t0_im - t2_im;
+		x1[0] = t1_re + t3_re; x1[1] = t1_im + t3_im;
+		x3[0] = t1_re - t3_re; x3[1] = t1_im - t3_im;
+	}
 
+	unsigned swaps;
+	unsigned swap_a[N / 2 + 1], swap_b[N / 2 + 1];
+	T twiddle_re[N], twiddle_im[N];
+};
 
 template<int BITS, typename T = float>
 class fft_context {
@@ -111,42 +258,26 @@ public:
 	typedef std::complex<T> value_type;
 	value_type data[N];
 	
+	fft_context() : core(core_type::get_shared()) {}
+	
 	inline void fft() {
-		scramble(data);
-		next_type::template apply<1>(data);
+		core.template apply<1>(data);
 	}
 
 	inline void ifft() {
-		scramble(data);
-		next_type::template apply<-1>(data);
+		core.template apply<-1>(data);
 		for(unsigned i = 0; i < N; ++i) {
 			data[i] /= N;
 		}
 	}
 	
 private:
-	typedef danielson_lanczos<N, T> next_type;
-
-	static inline void scramble(std::complex<T> * data) {
-		int j = 0;
-		for(int i = 0; i < N; ++i) {
-			if (i > j) {
-				std::swap(data[i], data[j]);
-			}
-			int m = N / 2;
-			while(j >= m && m >= 2) {
-				j -= m;
-				m >>= 1;
-			}
-			j += m;
-		}
-	}
+	typedef fft_core<BITS, T> core_type;
+	const core_type &core;
 };
 
 }
 
-#ifdef CLUNK_USES_SSE
-#	include "sse_fft_context.h"
-#endif
+//SSE specialization of fft_context<BITS, float> is opt-in, see sse_fft_context.h
 
 #endif
@@ -7,24 +7,29 @@
 
 namespace clunk {
 
+/*!
+	base of the window functions. derived class defines T operator()(int x) const, 
+	it is evaluated once for every x when shared tables are built, without virtual calls
+*/
 template<int N, typename T>
 struct window_func_base {
-	virtual ~window_func_base() {}
-	virtual T operator() (int x) const = 0;
-	void precalculate() {
-		for(int i = 0; i < N; ++i) {
-			cache[i] = (*this)(i);
-		}
-	}
 	T cache[N];
 };
 
+//window function used in ogg/vorbis
+template<int N, typename T>
+struct vorbis_window_func : public clunk::window_func_base<N, T> {
+	inline T operator()(int x) const {
+		T s = sin(T(M_PI) * (x + 0.5f) / N);
+		return sin(T(M_PI_2) * s * s); 
+	}
+};
+
 
 template<int BITS, template <int, typename> class window_func_type , typename T = float> 
 class mdct_context {
 
-	typedef fft_context<BITS - 2, T> fft_type;
-	fft_type fft;
+	typedef fft_core<BITS - 2, T> fft_type;
 
 public: 
 	enum { N = 1 << BITS , M = N / 2, N4 =  fft_type::N };
@@ -33,82 +38,181 @@ public:
 	typedef T value_type;
 	typedef std::complex<T> complex_type;
 
+	//! immutable window and twiddle tables, shared between all contexts of the same type
+	struct tables_type {
+		tables_type() : sqrt_N((T)sqrt((T)N)) {
+			for(int i = 0; i < N; ++i) {
+				window_func.cache[i] = window_func(i);
+			}
+			for(unsigned t = 0; t < N4; ++t) {
+				angle_cache[t] = std::polar<T>(1, 2 * T(M_PI) * (t + T(0.125)) / N);
+			}
+		}
+		
+		window_func_type<N, T> window_func;
+		std::complex<T> angle_cache[N4];
+		T sqrt_N;
+	};
+
 	T data[N];
 	
-	mdct_context() : sqrt_N((T)sqrt((T)N)) {
-		window_func.precalculate();
-		for(unsigned t = 0; t < N4; ++t) {
-			angle_cache[t] = std::polar<T>(1, 2 * T(M_PI) * (t + T(0.125)) / N);
-		}
+	mdct_context() : tables(get_tables()), fft(fft_type::get_shared()) {}
+	
+	static const tables_type & get_tables() {
+		static const tables_type shared_tables;
+		return shared_tables;
 	}
 	
 	void mdct() {
-		T rotate[N];
-		unsigned int t;
-		for(t = 0; t < N4; ++t) {
-			rotate[t] = -data[t + 3 * N4];
-		}
-		for(; t < N; ++t) {
-			rotate[t] = data[t - N4];
-		}
-		for(t = 0; t < N4; ++t) {
-			T re = (rotate[t * 2] - rotate[N - 1 - t * 2]) / 2;
-			T im = (rotate[M + t * 2] - rotate[M - 1 - t * 2]) / -2;
-			
-			std::complex<T> a = angle_cache[t];
-			fft.data[t] = std::complex<T>(re * a.real() + im * a.imag(), -re * a.imag() + im * a.real());
+		forward<false>();
+	}
+	
+	//! applies window to the data and transforms it, in one pass
+	void window_mdct() {
+		forward<true>();
+	}
+	
+	void imdct() {
+		inverse<false>();
+	}
+
+	//! inverse transform with the window applied to the result, in one pass
+	void imdct_window() {
+		inverse<true>();
+	}
+	
+	void apply_window() {
+		for(unsigned i = 0; i < N; ++i) {
+			data[i] *= tables.window_func.cache[i];
 		}
-		fft.fft();
+	}
+	
+	void clear() {
+		memset(data, 0, sizeof(data));
+	}
+	
+private:
+	const tables_type &tables;
+	const fft_type &fft;
+	//pre-twiddled input of the quarter size transform
+	std::complex<T> buffer[N4];
+	
+	template<bool WINDOW>
+	inline T windowed(unsigned i) const {
+		return WINDOW? data[i] * tables.window_func.cache[i]: data[i];
+	}
 
-		for(t = 0; t < N4; ++t) {
-		std::complex<T> a = angle_cache[t];
-			std::complex<T>& f = fft.data[t];
-			f = std::complex<T>(2 / sqrt_N * (f.real() * a.real() + f.imag() * a.imag()), 2 / sqrt_N * (-f.real() * a.imag() + f.imag() * a.real()));
+	template<bool WINDOW>
+	inline void store(unsigned i, T value) {
+		data[i] = WINDOW? value * tables.window_func.cache[i]: value;
+	}
+	
+	/*
+		input is rotated by N/4 with the first quarter negated, then folded: 
+		re(t) = (r[2t] - r[N - 1 - 2t]) / 2, im(t) = (r[M + 2t] - r[M - 1 - 2t]) / -2
+		rotation is resolved at compile time by splitting the loop at N4 / 2, so no temporary copy is needed
+	*/
+	template<bool WINDOW>
+	void forward() {
+		unsigned t;
+		for(t = 0; t < N4 / 2; ++t) {
+			T re = (-windowed<WINDOW>(3 * N4 + 2 * t) - windowed<WINDOW>(3 * N4 - 1 - 2 * t)) / 2;
+			T im = (windowed<WINDOW>(N4 + 2 * t) - windowed<WINDOW>(N4 - 1 - 2 * t)) / -2;
+			pre_twiddle(t, re, im);
+		}
+		for(; t < N4; ++t) {
+			T re = (windowed<WINDOW>(2 * t - N4) - windowed<WINDOW>(3 * N4 - 1 - 2 * t)) / 2;
+			T im = (windowed<WINDOW>(N4 + 2 * t) - -windowed<WINDOW>(N + N4 - 1 - 2 * t)) / -2;
+			pre_twiddle(t, re, im);
 		}
+		fft.template apply<1>(buffer);
 
 		for(t = 0; t < N4; ++t) {
-			data[2 * t] = fft.data[t].real();
-			data[M - 2 * t - 1] = -fft.data[t].imag();
+			std::complex<T> a = tables.angle_cache[t];
+			T re = buffer[t].real(), im = buffer[t].imag();
+			data[2 * t] = 2 / tables.sqrt_N * (re * a.real() + im * a.imag());
+			data[M - 2 * t - 1] = -2 / tables.sqrt_N * (-re * a.imag() + im * a.real());
 		}
 	}
 	
-	void imdct() {
-		unsigned int t; 
+	/*
+		post-twiddled output a(t), b(t) is unfolded to r[2t] = a, r[N - 1 - 2t] = -a, r[M + 2t] = b, r[M - 1 - 2t] = -b
+		and rotated back by N/4, every value is written right to its place
+	*/
+	template<bool WINDOW>
+	void inverse() {
+		unsigned t;
 		for(t = 0; t < N4; ++t) {
 			T re = data[t * 2] / 2, im = data[M - 1 - t * 2] / 2;
-			std::complex<T> a = angle_cache[t];
-			fft.data[t] = std::complex<T>(re * a.real() + im * a.imag(), - re * a.imag() + im * a.real());
+			pre_twiddle(t, re, im);
 		}
 		
-		fft.fft();
+		fft.template apply<1>(buffer);
 		
 		for(t = 0; t < N4; ++t) {
-			std::complex<T> a = angle_cache[t];
-			std::complex<T>& f = fft.data[t];
-			fft.data[t] = std::complex<T>(8 / sqrt_N * (f.real() * a.real() + f.imag() * a.imag()), 8 / sqrt_N * (-f.real() * a.imag() + f.imag() * a.real()));
+			std::complex<T> c = tables.angle_cache[t];
+			T re = buffer[t].real(), im = buffer[t].imag();
+			T a = 8 / tables.sqrt_N * (re * c.real() + im * c.imag());
+			T b = 8 / tables.sqrt_N * (-re * c.imag() + im * c.real());
+			if (t < N4 / 2) {
+				store<WINDOW>(2 * t + 3 * N4, -a);
+				store<WINDOW>(N4 - 1 - 2 * t, -b);
+			} else {
+				store<WINDOW>(2 * t - N4, a);
+				store<WINDOW>(N + N4 - 1 - 2 * t, b);
+			}
+			store<WINDOW>(3 * N4 - 1 - 2 * t, -a);
+			store<WINDOW>(N4 + 2 * t, b);
 		}
+	}
 
-		T rotate[N];
-		for(t = 0; t < N4; ++t) {
-			rotate[2 * t] = fft.data[t].real();
-			rotate[M + 2 * t] = fft.data[t].imag();
-		}
-		for(t = 1; t < N; t += 2) {
-			rotate[t] = - rotate[N - t - 1];
-		}
+	inline void pre_twiddle(unsigned t, T re, T im) {
+		std::complex<T> a = tables.angle_cache[t];
+		buffer[t] = std::complex<T>(re * a.real() + im * a.imag(), -re * a.imag() + im * a.real());
+	}
+};
 
-		//shift
-		for(t = 0; t < 3 * N4; ++t) {
-			data[t] = rotate[t + N4];
-		}
-		for(; t < N; ++t) {
-			data[t] = -rotate[t - 3 * N4];
-		}
+/*!
+	K independent transforms of the same shape processed at once, one per lane. 
+	sample i of the transform k is data[i][k], loops over lanes are innermost, so they are vectorized. 
+	Tables are shared with mdct_context.
+*/
+template<int BITS, template <int, typename> class window_func_type , typename T, int K> 
+class mdct_batch {
+	typedef mdct_context<BITS, window_func_type, T> context_type;
+	typedef fft_core<BITS - 2, T> fft_type;
+
+public: 
+	enum { N = context_type::N, M = context_type::M, N4 = context_type::N4, LANES = K };
+	typedef T value_type;
+
+	T data[N][K];
+
+	mdct_batch() : tables(context_type::get_tables()), fft(fft_type::get_shared()) {}
+	
+	void mdct() {
+		forward<false>();
+	}
+	
+	//! applies window to the data and transforms it, in one pass
+	void window_mdct() {
+		forward<true>();
+	}
+	
+	void imdct() {
+		inverse<false>();
+	}
+
+	//! inverse transform with the window applied to the result, in one pass
+	void imdct_window() {
+		inverse<true>();
 	}
 	
 	void apply_window() {
 		for(unsigned i = 0; i < N; ++i) {
-			data[i] *= window_func.cache[i];
+			const T w = tables.window_func.cache[i];
+			for(int k = 0; k < K; ++k)
+				data[i][k] *= w;
 		}
 	}
 	
@@ -117,10 +221,95 @@ public:
 	}
 	
 private:
-	window_func_type<N, T> window_func;
+	const typename context_type::tables_type &tables;
+	const fft_type &fft;
+	T fft_re[N4][K], fft_im[N4][K];
+
+	template<bool WINDOW>
+	inline T windowed(unsigned i, int k) const {
+		return WINDOW? data[i][k] * tables.window_func.cache[i]: data[i][k];
+	}
+
+	template<bool WINDOW>
+	inline void store(unsigned i, int k, T value) {
+		data[i][k] = WINDOW? value * tables.window_func.cache[i]: value;
+	}
+	
+	inline void pre_twiddle(unsigned t, int k, T re, T im) {
+		const std::complex<T> &a = tables.angle_cache[t];
+		fft_re[t][k] = re * a.real() + im * a.imag();
+		fft_im[t][k] = -re * a.imag() + im * a.real();
+	}
+
+	//see mdct_context::forward
+	template<bool WINDOW>
+	void forward() {
+		unsigned t;
+		int k;
+		for(t = 0; t < N4 / 2; ++t) {
+			for(k = 0; k < K; ++k) {
+				T re = (-windowed<WINDOW>(3 * N4 + 2 * t, k) - windowed<WINDOW>(3 * N4 - 1 - 2 * t, k)) / 2;
+				T im = (windowed<WINDOW>(N4 + 2 * t, k) - windowed<WINDOW>(N4 - 1 - 2 * t, k)) / -2;
+				pre_twiddle(t, k, re, im);
+			}
+		}
+		for(; t < N4; ++t) {
+			for(k = 0; k < K; ++k) {
+				T re = (windowed<WINDOW>(2 * t - N4, k) - windowed<WINDOW>(3 * N4 - 1 - 2 * t, k)) / 2;
+				T im = (windowed<WINDOW>(N4 + 2 * t, k) - -windowed<WINDOW>(N + N4 - 1 - 2 * t, k)) / -2;
+				pre_twiddle(t, k, re, im);
+			}
+		}
+		fft.template apply_batch<1, K>(fft_re[0], fft_im[0]);
+
+		for(t = 0; t < N4; ++t) {
+			const std::complex<T> a = tables.angle_cache[t];
+			for(k = 0; k < K; ++k) {
+				T re = fft_re[t][k], im = fft_im[t][k];
+				data[2 * t][k] = 2 / tables.sqrt_N * (re * a.real() + im * a.imag());
+				data[M - 2 * t - 1][k] = -2 / tables.sqrt_N * (-re * a.imag() + im * a.real());
+			}
+		}
+	}
 	
-	std::complex<T> angle_cache[N4];
-	T sqrt_N;
+	//see mdct_context::inverse
+	template<bool WINDOW>
+	void inverse() {
+		unsigned t;
+		int k;
+		for(t = 0; t < N4; ++t) {
+			for(k = 0; k < K; ++k)
+				pre_twiddle(t, k, data[t * 2][k] / 2, data[M - 1 - t * 2][k] / 2);
+		}
+		
+		fft.template apply_batch<1, K>(fft_re[0], fft_im[0]);
+		
+		const T scale = 8 / tables.sqrt_N;
+		for(t = 0; t < N4 / 2; ++t) {
+			const std::complex<T> c = tables.angle_cache[t];
+			for(k = 0; k < K; ++k) {
+				T re = fft_re[t][k], im = fft_im[t][k];
+				T a = scale * (re * c.real() + im * c.imag());
+				T b = scale * (-re * c.imag() + im * c.real());
+				store<WINDOW>(2 * t + 3 * N4, k, -a);
+				store<WINDOW>(N4 - 1 - 2 * t, k, -b);
+				store<WINDOW>(3 * N4 - 1 - 2 * t, k, -a);
+				store<WINDOW>(N4 + 2 * t, k, b);
+			}
+		}
+		for(; t < N4; ++t) {
+			const std::complex<T> c = tables.angle_cache[t];
+			for(k = 0; k < K; ++k) {
+				T re = fft_re[t][k], im = fft_im[t][k];
+				T a = scale * (re * c.real() + im * c.imag());
+				T b = scale * (-re * c.imag() + im * c.real());
+				store<WINDOW>(2 * t - N4, k, a);
+				store<WINDOW>(N + N4 - 1 - 2 * t, k, b);
+				store<WINDOW>(3 * N4 - 1 - 2 * t, k, -a);
+				store<WINDOW>(N4 + 2 * t, k, b);
+			}
+		}
+	}
 };
 
 }
@@ -22,106 +22,151 @@
 #include "locker.h"
 #include "source.h"
 
+
 using namespace clunk;
 
-Object::Object(Context *context) : context(context), dead(false) {}
+SourceMap::iterator SourceMap::lower_bound(int key) const {
+	source_node *n = head;
+	while(n != NULL && n->first < key)
+		n = n->next;
+	return iterator(n);
+}
+
+SourceMap::iterator SourceMap::upper_bound(int key) const {
+	source_node *n = head;
+	while(n != NULL && n->first <= key)
+		n = n->next;
+	return iterator(n);
+}
+
+SourceMap::iterator SourceMap::find(int key) const {
+	iterator i = lower_bound(key);
+	return (i != end() && i->first == key)? i: end();
+}
+
+void SourceMap::insert(int key, Source *source) {
+	source_node *node = &source->node;
+	node->first = key;
+	node->second = source;
+	
+	source_node *prev = NULL, *next = head;
+	while(next != NULL && next->first <= key) {
+		prev = next;
+		next = next->next;
+	}
+	node->prev = prev;
+	node->next = next;
+	if (prev != NULL)
+		prev->next = node;
+	else 
+		head = node;
+	if (next != NULL)
+		next->prev = node;
+}
+
+void SourceMap::erase(iterator i) {
+	source_node *node = i.node;
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else 
+		head = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	node->prev = node->next = NULL;
+}
+
+Object::Object(Context *context) : context(context), handle(0) {}
 
 void Object::update(const v3<float> &pos, const v3<float> &vel, const v3<float> &dir) {
-	AudioLocker l;
-	position = pos;
-	velocity = vel;
-	direction = dir;
+	context->set_transform(this, Context::transform::All, pos, vel, dir);
 }
 
 void Object::set_position(const v3<float> &pos) {
-	AudioLocker l;
-	position = pos;
+	context->set_transform(this, Context::transform::Position, pos, v3<float>(), v3<float>());
 }
 
 void Object::set_velocity(const v3<float> &vel) {
-	AudioLocker l;
-	velocity = vel;
+	context->set_transform(this, Context::transform::Velocity, v3<float>(), vel, v3<float>());
 }
 
 void Object::set_direction(const v3<float> &dir) {
-	AudioLocker l;
-	direction = dir;
+	context->set_transform(this, Context::transform::Direction, v3<float>(), v3<float>(), dir);
 }
 
 void Object::play(const std::string &name, Source *source) {
-	AudioLocker l;
-	named_sources.insert(NamedSources::value_type(name, source));
+	int id = context->get_source_id(name);
+	source->_reserve(context->get_spec().samples);
+	Context::command *c = context->get_command(Context::command::Play, this);
+	c->set_name(id);
+	c->source = source;
+	context->push_command();
 }
 
 void Object::play(int index, Source *source) {
-	AudioLocker l;
-	indexed_sources.insert(IndexedSources::value_type(index, source));
+	source->_reserve(context->get_spec().samples);
+	Context::command *c = context->get_command(Context::command::Play, this);
+	c->set_index(index);
+	c->source = source;
+	context->push_command();
 }
 
 bool Object::playing(const std::string &name) const {
+	int id = context->find_source_id(name);
+	if (id < 0)
+		return false;
 	AudioLocker l;
-	return named_sources.find(name) != named_sources.end();
+	context->flush_commands();
+	return named_sources.find(id) != named_sources.end();
 }
 
 bool Object::playing(int index) const {
 	AudioLocker l;
+	context->flush_commands();
 	return indexed_sources.find(index) != indexed_sources.end();
 }
 
 void Object::fade_out(const std::string &name, float fadeout) {
-	AudioLocker l;
-	NamedSources::iterator b = named_sources.lower_bound(name);
-	NamedSources::iterator e = named_sources.upper_bound(name);
-	for(NamedSources::iterator i = b; i != e; ++i) {
-		i->second->fade_out(fadeout);
-	}
+	int id = context->find_source_id(name);
+	if (id < 0)
+		return;
+	Context::command *c = context->get_command(Context::command::FadeOut, this);
+	c->set_name(id);
+	c->fadeout = fadeout;
+	context->push_command();
 }
 
 void Object::fade_out(int index, float fadeout) {
-	AudioLocker l;
-	IndexedSources::iterator b = indexed_sources.lower_bound(index);
-	IndexedSources::iterator e = indexed_sources.upper_bound(index);
-	for(IndexedSources::iterator i = b; i != e; ++i) {
-		i->second->fade_out(fadeout);
-	}
+	Context::command *c = context->get_command(Context::command::FadeOut, this);
+	c->set_index(index);
+	c->fadeout = fadeout;
+	context->push_command();
 }
 
 void Object::cancel(const std::string &name, float fadeout) {
-	AudioLocker l;
-	NamedSources::iterator b = named_sources.lower_bound(name);
-	NamedSources::iterator e = named_sources.upper_bound(name);
-	for(NamedSources::iterator i = b; i != e; ) {
-		if (fadeout == 0) {
-			//quickly destroy source
-			delete i->second;
-			named_sources.erase(i++);
-			continue;
-		} else if (i->second->loop)
-			i->second->fade_out(fadeout);
-		++i;
-	}
+	int id = context->find_source_id(name);
+	if (id < 0)
+		return;
+	Context::command *c = context->get_command(Context::command::Cancel, this);
+	c->set_name(id);
+	c->fadeout = fadeout;
+	context->push_command();
 }
 
 void Object::cancel(int index, float fadeout) {
-	AudioLocker l;
-	IndexedSources::iterator b = indexed_sources.lower_bound(index);
-	IndexedSources::iterator e = indexed_sources.upper_bound(index);
-	for(IndexedSources::iterator i = b; i != e; ) {
-		if (fadeout == 0) {
-			//quickly destroy source
-			delete i->second;
-			indexed_sources.erase(i++);
-			continue;
-		} else if (i->second->loop)
-			i->second->fade_out(fadeout);
-		++i;
-	}
+	Context::command *c = context->get_command(Context::command::Cancel, this);
+	c->set_index(index);
+	c->fadeout = fadeout;
+	context->push_command();
 }
 
 bool Object::get_loop(const std::string &name) {
+	int id = context->find_source_id(name);
+	if (id < 0)
+		return false;
 	AudioLocker l;
-	NamedSources::iterator b = named_sources.lower_bound(name);
-	NamedSources::iterator e = named_sources.upper_bound(name);
+	context->flush_commands();
+	NamedSources::iterator b = named_sources.lower_bound(id);
+	NamedSources::iterator e = named_sources.upper_bound(id);
 	for(NamedSources::iterator i = b; i != e; ++i) {
 		if (i->second->loop)
 			return true;
@@ -131,6 +176,7 @@ bool Object::get_loop(const std::string &name) {
 
 bool Object::get_loop(int index) {
 	AudioLocker l;
+	context->flush_commands();
 	IndexedSources::iterator b = indexed_sources.lower_bound(index);
 	IndexedSources::iterator e = indexed_sources.upper_bound(index);
 	for(IndexedSources::iterator i = b; i != e; ++i) {
@@ -140,61 +186,126 @@ bool Object::get_loop(int index) {
 	return false;
 }
 
-
 void Object::set_loop(const std::string &name, const bool loop) {
-	AudioLocker l;
-	NamedSources::iterator b = named_sources.lower_bound(name);
-	NamedSources::iterator e = named_sources.upper_bound(name);
-	for(NamedSources::iterator i = b; i != e; ++i) {
-		i->second->loop = i == b? loop: false; //set loop only for the first. disable others. 
-	}
+	int id = context->find_source_id(name);
+	if (id < 0)
+		return;
+	Context::command *c = context->get_command(Context::command::SetLoop, this);
+	c->set_name(id);
+	c->loop = loop;
+	context->push_command();
 }
 
 void Object::set_loop(int index, const bool loop) {
-	AudioLocker l;
-	IndexedSources::iterator b = indexed_sources.lower_bound(index);
-	IndexedSources::iterator e = indexed_sources.upper_bound(index);
-	for(IndexedSources::iterator i = b; i != e; ++i) {
-		i->second->loop = i == b? loop: false; //set loop only for the first. disable others. 
-	}
-}
-
-template<class Sources>
-void _cancel_all(Sources &sources, bool force, float fadeout) {
-	for(typename Sources::iterator i = sources.begin(); i != sources.end(); ++i) {
-		if (force) {
-			delete i->second;
-		} else {
-			if (i->second->loop)
-				i->second->fade_out(fadeout);
-		}
-	}
-	if (force) {
-		sources.clear();
-	}
+	Context::command *c = context->get_command(Context::command::SetLoop, this);
+	c->set_index(index);
+	c->loop = loop;
+	context->push_command();
 }
 
 void Object::cancel_all(bool force, float fadeout) {
-	AudioLocker l;
-	_cancel_all(indexed_sources, force, fadeout);
-	_cancel_all(named_sources, force, fadeout);
+	Context::command *c = context->get_command(Context::command::CancelAll, this);
+	c->force = force;
+	c->fadeout = fadeout;
+	context->push_command();
 }
 
 Object::~Object() {
-	if (dead)
+	if (context->emitters.flags[handle] & Context::emitters_type::Dead)
 		return;
 	AudioLocker l;
-	cancel_all();
+	context->flush_commands();
+	_cancel_all(false, 0.1f);
 	context->delete_object(this);
 }
 
 bool Object::active() const {
 	AudioLocker l;
+	context->flush_commands();
 	return !indexed_sources.empty() || !named_sources.empty();
 }
 
 void Object::autodelete() {
-	AudioLocker l;
-	cancel_all();
-	dead = true;
+	context->get_command(Context::command::Autodelete, this);
+	context->push_command();
+}
+
+//commands implementation, called from the audio thread
+
+template<class Sources>
+static void fade_out_key(Sources &sources, int key, float fadeout) {
+	typename Sources::iterator b = sources.lower_bound(key);
+	typename Sources::iterator e = sources.upper_bound(key);
+	for(typename Sources::iterator i = b; i != e; ++i) {
+		i->second->fade_out(fadeout);
+	}
+}
+
+void Object::_fade_out(bool named, int key, float fadeout) {
+	if (named)
+		fade_out_key(named_sources, key, fadeout);
+	else 
+		fade_out_key(indexed_sources, key, fadeout);
+}
+
+template<class Sources>
+static void cancel_key(Sources &sources, int key, float fadeout) {
+	typename Sources::iterator b = sources.lower_bound(key);
+	typename Sources::iterator e = sources.upper_bound(key);
+	for(typename Sources::iterator i = b; i != e; ) {
+		if (fadeout == 0) {
+			//quickly destroy source
+			Source *s = i->second;
+			sources.erase(i++);
+			delete s;
+			continue;
+		} else if (i->second->loop)
+			i->second->fade_out(fadeout);
+		++i;
+	}
+}
+
+void Object::_cancel(bool named, int key, float fadeout) {
+	if (named)
+		cancel_key(named_sources, key, fadeout);
+	else 
+		cancel_key(indexed_sources, key, fadeout);
+}
+
+template<class Sources>
+static void set_loop_key(Sources &sources, int key, const bool loop) {
+	typename Sources::iterator b = sources.lower_bound(key);
+	typename Sources::iterator e = sources.upper_bound(key);
+	for(typename Sources::iterator i = b; i != e; ++i) {
+		i->second->loop = i == b? loop: false; //set loop only for the first. disable others. 
+	}
+}
+
+void Object::_set_loop(bool named, int key, const bool loop) {
+	if (named)
+		set_loop_key(named_sources, key, loop);
+	else 
+		set_loop_key(indexed_sources, key, loop);
+}
+
+template<class Sources>
+void cancel_sources(Sources &sources, bool force, float fadeout) {
+	for(typename Sources::iterator i = sources.begin(); i != sources.end(); ) {
+		//node lives in the source, step over it before deleting
+		Source *s = (i++)->second;
+		if (force) {
+			delete s;
+		} else {
+			if (s->loop)
+				s->fade_out(fadeout);
+		}
+	}
+	if (force) {
+		sources.clear();
+	}
+}
+
+void Object::_cancel_all(bool force, float fadeout) {
+	cancel_sources(indexed_sources, force, fadeout);
+	cancel_sources(named_sources, force, fadeout);
 }
@@ -20,7 +20,6 @@
 */
 
 #include <string>
-#include <map>
 #include "export_clunk.h"
 #include "v3.h"
 
@@ -28,22 +27,73 @@ namespace clunk {
 class Context;
 class Source;
 
+//! node of the clunk::SourceMap embedded in the source, so key and source read like the pair of std::multimap
+struct source_node {
+	int first;
+	Source *second;
+	source_node *prev, *next;
+	
+	inline source_node() : first(0), second(NULL), prev(NULL), next(NULL) {}
+};
+
+/*! 
+	rief for the internal use only. 
+	\internal Sources of the object ordered by key, with the interface of std::multimap used by the object and context. 
+	Nodes are embedded in the sources, so playing the source only links it in place and never allocates. 
+	Sources with the same key keep the order they were inserted in.
+*/
+class CLUNKAPI SourceMap {
+public: 
+	class iterator {
+	public: 
+		inline iterator(source_node *node = NULL) : node(node) {}
+		inline source_node & operator*() const { return *node; }
+		inline source_node * operator->() const { return node; }
+		inline iterator & operator++() { node = node->next; return *this; }
+		inline iterator operator++(int) { iterator i(*this); node = node->next; return i; }
+		inline bool operator==(const iterator &other) const { return node == other.node; }
+		inline bool operator!=(const iterator &other) const { return node != other.node; }
+	private: 
+		friend class SourceMap;
+		source_node *node;
+	};
+	
+	inline SourceMap() : head(NULL) {}
+	
+	inline bool empty() const { return head == NULL; }
+	inline iterator begin() const { return iterator(head); }
+	inline iterator end() const { return iterator(); }
+	
+	///first source with the key not less than given
+	iterator lower_bound(int key) const;
+	///first source with the key greater than given
+	iterator upper_bound(int key) const;
+	iterator find(int key) const;
+	
+	///links source after all sources with the same key
+	void insert(int key, Source *source);
+	///unlinks source, does not delete it
+	void erase(iterator i);
+	///unlinks all sources
+	inline void clear() { head = NULL; }
+	
+private: 
+	SourceMap(const SourceMap &);
+	const SourceMap& operator=(const SourceMap &);
+	
+	source_node *head;
+};
+
 /*! 
 	\brief Object containing sources.
-	Objects - class containing several playing sources and controlling its behaviour
+	Objects - class containing several playing sources and controlling its behaviour. 
+	Object is a handle: its position, velocity and direction are stored in the clunk::Context. 
+	Methods changing object do not lock audio, they are queued and applied at the beginning of the next period. 
+	Queue has single producer, so call them from the one thread only. 
 */
 
 class CLUNKAPI Object {
 public: 
-	friend struct DistanceOrder;
-	struct DistanceOrder {
-		v3<float> listener;
-		DistanceOrder(const v3<float> &listener) : listener(listener) {}
-
-		inline bool operator()(const Object *a, const Object * b) const {
-			return listener.quick_distance(a->position) < listener.quick_distance(b->position); 
-		}
-	};
 	///dtor, do not forget to delete object if you do not need it anymore
 	~Object();
 
@@ -174,15 +224,22 @@ private:
 	friend class Context;
 	
 	Object(Context *context);
+	
+	//queued commands implementation, key is the index or id of the interned name
+	void _fade_out(bool named, int key, float fadeout);
+	void _cancel(bool named, int key, float fadeout);
+	void _set_loop(bool named, int key, const bool loop);
+	void _cancel_all(bool force, float fadeout);
+	
 	Context *context;
-	v3<float> position, velocity, direction;
+	//index of the object's position, velocity and mixing state in the context
+	unsigned handle;
 
-	typedef std::multimap<const std::string, Source *> NamedSources;
+	//sources played by name, keyed by the name's id interned by the context
+	typedef SourceMap NamedSources;
 	NamedSources named_sources;
-	typedef std::multimap<const int, Source *> IndexedSources;
+	typedef SourceMap IndexedSources;
 	IndexedSources indexed_sources;
-	
-	bool dead;
 };
 }
 
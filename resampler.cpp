@@ -0,0 +1,233 @@
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "resampler.h"
+#include "buffer.h"
+#include "clunk_ex.h"
+#include "cpu_features.h"
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+#ifdef CLUNK_USES_SSE
+#	include <xmmintrin.h>
+#endif
+#ifdef CLUNK_USES_AVX
+#	include <immintrin.h>
+#endif
+
+using namespace clunk;
+
+Resampler::Resampler() : src_rate(0), dst_rate(0), channels(0), taps(0), padded_taps(0), available(0), position(0), fraction(0) {}
+
+void Resampler::init(int src_rate, int dst_rate, int channels, Quality quality) {
+	if (src_rate <= 0 || dst_rate <= 0 || channels <= 0)
+		throw_ex(("invalid resampler parameters: %d -> %d, %d channels", src_rate, dst_rate, channels));
+	
+	this->src_rate = src_rate;
+	this->dst_rate = dst_rate;
+	this->channels = channels;
+	
+	switch(quality) {
+	case Low: 
+		taps = 2;
+		break;
+	case Medium: 
+		taps = 16;
+		break;
+	default: 
+		taps = 48;
+	}
+	padded_taps = (taps + 3) & ~3;
+	
+	//lowering cutoff when downsampling to avoid aliasing
+	float cutoff = 0.95f * (dst_rate < src_rate? (float)dst_rate / src_rate: 1.0f);
+	const int half = taps / 2;
+	
+	table.resize((PHASES + 1) * padded_taps);
+	for(int p = 0; p <= PHASES; ++p) {
+		float *row = &table[p * padded_taps];
+		float sum = 0;
+		for(int k = 0; k < padded_taps; ++k) {
+			float t = k - (half - 1) - (float)p / PHASES, h = 0;
+			if (k >= taps) {
+				h = 0;
+			} else if (quality == Low) {
+				h = fabsf(t) < 1? 1 - fabsf(t): 0;
+			} else if (fabsf(t) < half) {
+				float x = (float)M_PI * cutoff * t;
+				float sinc = x != 0? sinf(x) / x: 1.0f;
+				float w = (float)M_PI * t / half;
+				h = cutoff * sinc * (0.42f + 0.5f * cosf(w) + 0.08f * cosf(2 * w));
+			}
+			row[k] = h;
+			sum += h;
+		}
+		//unity gain for the constant signal
+		for(int k = 0; k < padded_taps; ++k) {
+			row[k] /= sum;
+		}
+	}
+	coeffs.resize(padded_taps);
+	
+	//unused history is always shorter than the filter, so it fits along with the whole chunk
+	input.resize(channels);
+	for(int c = 0; c < channels; ++c) 
+		input[c].resize(padded_taps + CHUNK_FRAMES);
+	reset();
+}
+
+void Resampler::reset() {
+	available = taps / 2 - 1;
+	for(size_t c = 0; c < input.size(); ++c) {
+		std::fill(input[c].begin(), input[c].begin() + available, 0.0f);
+	}
+	position = available;
+	fraction = 0;
+}
+
+#ifdef CLUNK_USES_AVX
+static CLUNK_TARGET("avx") float convolve_avx(const float *src, const float *coeffs, int n) {
+	__m256 sum = _mm256_setzero_ps();
+	int i = 0;
+	for(; i + 8 <= n; i += 8) {
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(src + i), _mm256_loadu_ps(coeffs + i)));
+	}
+	__m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	if (i < n)
+		sum4 = _mm_add_ps(sum4, _mm_mul_ps(_mm_loadu_ps(src + i), _mm_loadu_ps(coeffs + i)));
+	float r[4];
+	_mm_storeu_ps(r, sum4);
+	return (r[0] + r[1]) + (r[2] + r[3]);
+}
+
+static CLUNK_TARGET("avx512f") float convolve_avx512(const float *src, const float *coeffs, int n) {
+	__m512 sum = _mm512_setzero_ps();
+	int i = 0;
+	for(; i + 16 <= n; i += 16) {
+		sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_loadu_ps(src + i), _mm512_loadu_ps(coeffs + i)));
+	}
+	if (i < n) {
+		//masked lanes are loaded as zeros
+		const __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+		sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_maskz_loadu_ps(tail, src + i), _mm512_maskz_loadu_ps(tail, coeffs + i)));
+	}
+	float r[16];
+	_mm512_storeu_ps(r, sum);
+	for(int k = 0; k < 4; ++k)
+		r[k] = (r[k] + r[k + 4]) + (r[k + 8] + r[k + 12]);
+	return (r[0] + r[1]) + (r[2] + r[3]);
+}
+#endif
+
+float Resampler::convolve(const float *src, const float *coeffs, int n) {
+#ifdef CLUNK_USES_AVX
+	if (cpu_features::has(cpu_features::AVX512F))
+		return convolve_avx512(src, coeffs, n);
+	if (cpu_features::has(cpu_features::AVX))
+		return convolve_avx(src, coeffs, n);
+#endif
+#ifdef CLUNK_USES_SSE
+	if (cpu_features::has(cpu_features::SSE2)) {
+		__m128 sum = _mm_setzero_ps();
+		for(int i = 0; i < n; i += 4) {
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(src + i), _mm_loadu_ps(coeffs + i)));
+		}
+		float r[4];
+		_mm_storeu_ps(r, sum);
+		return (r[0] + r[1]) + (r[2] + r[3]);
+	}
+#endif
+	float sum[4] = {0, 0, 0, 0};
+	for(int i = 0; i < n; i += 4) {
+		sum[0] += src[i] * coeffs[i];
+		sum[1] += src[i + 1] * coeffs[i + 1];
+		sum[2] += src[i + 2] * coeffs[i + 2];
+		sum[3] += src[i + 3] * coeffs[i + 3];
+	}
+	return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+void Resampler::process(clunk::Buffer &dst, const Sint16 *src, unsigned frames) {
+	if (channels == 0)
+		throw_ex(("resampler was not initialized"));
+	
+	while(frames > 0) {
+		unsigned n = (unsigned)input[0].size() - available;
+		if (n > frames)
+			n = frames;
+		for(int c = 0; c < channels; ++c) {
+			float *in = &input[c][available];
+			for(unsigned i = 0; i < n; ++i) {
+				in[i] = src[i * channels + c];
+			}
+		}
+		available += n;
+		src += n * channels;
+		frames -= n;
+		convert(dst);
+	}
+}
+
+void Resampler::convert(clunk::Buffer &dst) {
+	const unsigned history = taps / 2 - 1;
+	//first input sample used by the output is position - history, filter reads padded_taps samples from there
+	if (position - history + padded_taps > available)
+		return;
+	
+	unsigned max_n = (unsigned)((double)(available - position) * dst_rate / src_rate) + 2;
+	size_t start = dst.get_size();
+	dst.set_size(start + max_n * channels * sizeof(Sint16));
+	Sint16 *out = (Sint16 *)((unsigned char *)dst.get_ptr() + start);
+	
+	unsigned n = 0;
+	while(position - history + padded_taps <= available) {
+		assert(n < max_n);
+		unsigned phase = fraction * PHASES / dst_rate;
+		float f = (float)(fraction * PHASES - phase * dst_rate) / dst_rate;
+		const float *a = &table[phase * padded_taps], *b = a + padded_taps;
+		for(int k = 0; k < padded_taps; ++k) {
+			coeffs[k] = a[k] + f * (b[k] - a[k]);
+		}
+		
+		for(int c = 0; c < channels; ++c) {
+			float v = convolve(&input[c][position - history], &coeffs[0], padded_taps);
+			if (v > 32767)
+				v = 32767;
+			else if (v < -32768)
+				v = -32768;
+			*out++ = (Sint16)v;
+		}
+		++n;
+		
+		fraction += src_rate;
+		position += fraction / dst_rate;
+		fraction %= dst_rate;
+	}
+	dst.set_size(start + n * channels * sizeof(Sint16));
+	
+	//moving samples which will be used again to the front, less than the filter length is left
+	unsigned used = position - history;
+	if (used > available)
+		used = available;
+	for(int c = 0; c < channels; ++c) {
+		std::copy(input[c].begin() + used, input[c].begin() + available, input[c].begin());
+	}
+	available -= used;
+	position -= used;
+}
@@ -0,0 +1,100 @@
+#ifndef CLUNK_RESAMPLER_H__
+#define CLUNK_RESAMPLER_H__
+
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <sys/types.h>
+#include <vector>
+#include <SDL_audio.h>
+#include "export_clunk.h"
+
+namespace clunk {
+class Buffer;
+
+/*!
+	\brief Streaming sample rate converter
+	Polyphase windowed sinc resampler for the 16 bit interleaved audio. 
+	It keeps filter history between the calls, so data could be converted chunk by chunk without clicks on the chunk boundaries.
+*/
+
+class CLUNKAPI Resampler {
+public: 
+	///quality of the resampling, higher quality uses more taps per output sample
+	enum Quality { 
+		Low, ///< linear interpolation
+		Medium, ///< 16 taps sinc
+		High ///< 48 taps sinc
+	};
+	
+	Resampler();
+	
+	/*! 
+		\brief prepares resampler, drops history
+		\param[in] src_rate sample rate of the input
+		\param[in] dst_rate sample rate of the output
+		\param[in] channels number of channels 
+		\param[in] quality quality of the filter
+	*/
+	void init(int src_rate, int dst_rate, int channels, Quality quality);
+	
+	///returns true if resampler was initialized with the given parameters
+	inline bool matches(int src_rate, int dst_rate, int channels) const {
+		return this->src_rate == src_rate && this->dst_rate == dst_rate && this->channels == channels;
+	}
+	
+	///drops history, next chunk starts from silence
+	void reset();
+	
+	/*!
+		\brief converts next chunk of the data
+		\param[out] dst converted data is appended here
+		\param[in] src input samples
+		\param[in] frames number of input frames (samples of all channels)
+	*/
+	void process(clunk::Buffer &dst, const Sint16 *src, unsigned frames);
+	
+	/*!
+		\brief dot product of the input and the coefficients, n is a multiple of 4
+		uses the widest simd kernel reported by cpu_features, sinc interpolation of the sources shares it
+	*/
+	static float convolve(const float *src, const float *coeffs, int n);
+	
+private: 
+	//resamples buffered input, keeps the samples needed by the next output
+	void convert(clunk::Buffer &dst);
+	
+	enum { PHASES = 256 };
+	//input frames buffered at once, longer chunks are converted piece by piece
+	enum { CHUNK_FRAMES = 1024 };
+	int src_rate, dst_rate, channels;
+	//filter length rounded up to 4 and filter table: PHASES + 1 rows
+	int taps, padded_taps;
+	std::vector<float> table;
+	
+	//input history per channel allocated by init(), number of buffered samples 
+	//and position of the next output sample in it: integer part and fraction in 1/dst_rate units.
+	std::vector<std::vector<float> > input;
+	unsigned available, position, fraction;
+	//interpolated coefficients of the current phase
+	std::vector<float> coeffs;
+};
+
+}
+
+#endif
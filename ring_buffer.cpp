@@ -0,0 +1,138 @@
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "ring_buffer.h"
+#include "buffer.h"
+#include "clunk_ex.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+using namespace clunk;
+
+RingBuffer::~RingBuffer() {
+	free(ptr);
+}
+
+const RingBuffer& RingBuffer::operator=(const RingBuffer &c) {
+	if (this == &c)
+		return *this;
+	
+	clear();
+	if (c.size == 0)
+		return *this;
+	
+	reserve(c.size);
+	c.peek(ptr, 0, c.size);
+	size = c.size;
+	return *this;
+}
+
+void RingBuffer::set_capacity(size_t c) {
+	if (c > capacity)
+		grow(c);
+}
+
+void RingBuffer::grow(size_t c) {
+	if (c < capacity * 2)
+		c = capacity * 2;
+	
+	unsigned char *p = (unsigned char *)malloc(c);
+	if (p == NULL) 
+		throw_io(("malloc(%u)", (unsigned)c));
+	if (Buffer::allocation_hook != NULL)
+		Buffer::allocation_hook(c);
+	
+	peek(p, 0, size);
+	free(ptr);
+	ptr = p;
+	capacity = c;
+	head = 0;
+}
+
+const void *RingBuffer::get_span(size_t offset, size_t &n) const {
+	if (offset >= size) {
+		n = 0;
+		return NULL;
+	}
+	size_t pos = head + offset;
+	if (pos >= capacity)
+		pos -= capacity;
+	
+	n = size - offset;
+	if (pos + n > capacity)
+		n = capacity - pos;
+	return ptr + pos;
+}
+
+void *RingBuffer::get_free_span(size_t &n) {
+	size_t pos = head + size;
+	if (pos >= capacity)
+		pos -= capacity;
+	
+	n = capacity - size;
+	if (pos + n > capacity)
+		n = capacity - pos;
+	return ptr + pos;
+}
+
+void RingBuffer::push(size_t n) {
+	assert(size + n <= capacity);
+	size += n;
+}
+
+void RingBuffer::push(const void *data, size_t n) {
+	reserve(n);
+	const unsigned char *src = (const unsigned char *)data;
+	while(n > 0) {
+		size_t span;
+		void *dst = get_free_span(span);
+		if (span > n)
+			span = n;
+		memcpy(dst, src, span);
+		src += span;
+		size += span;
+		n -= span;
+	}
+}
+
+void RingBuffer::peek(void *dst, size_t offset, size_t n) const {
+	assert(offset + n <= size);
+	unsigned char *d = (unsigned char *)dst;
+	while(n > 0) {
+		size_t span;
+		const void *src = get_span(offset, span);
+		if (span > n)
+			span = n;
+		memcpy(d, src, span);
+		d += span;
+		offset += span;
+		n -= span;
+	}
+}
+
+void RingBuffer::pop(size_t n) {
+	if (n >= size) {
+		clear();
+		return;
+	}
+	head += n;
+	if (head >= capacity)
+		head -= capacity;
+	size -= n;
+}
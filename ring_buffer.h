@@ -0,0 +1,95 @@
+#ifndef CLUNK_RING_BUFFER_H__
+#define CLUNK_RING_BUFFER_H__
+
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <sys/types.h>
+#include <stddef.h>
+#include "export_clunk.h"
+
+namespace clunk {
+
+/*!
+	\brief Ring buffer of bytes
+	FIFO on top of the single malloc'ed memory block. Pushing and popping do not move data, 
+	data could wrap around the end of the memory, so it's accessed with up to two contiguous spans.
+	Buffer grows only if pushed data does not fit into its capacity.
+*/
+
+class CLUNKAPI RingBuffer {
+public: 
+	//! Default ctor, empty buffer.
+	inline RingBuffer() : ptr(NULL), capacity(0), head(0), size(0) {}
+	//! Copy ctor
+	inline RingBuffer(const RingBuffer &c) : ptr(NULL), capacity(0), head(0), size(0) { *this = c; }
+	//! Copies contents of the other buffer
+	const RingBuffer& operator=(const RingBuffer &c);
+	//! Destructor, deallocates buffer if needed
+	~RingBuffer();
+	
+	//! Gets number of bytes stored
+	inline size_t get_size() const { return size; }
+	//! Gets size of the allocated memory
+	inline size_t get_capacity() const { return capacity; }
+	//! Gets number of bytes which could be pushed without allocation
+	inline size_t get_free() const { return capacity - size; }
+	//! Tests if buffer is empty
+	inline bool empty() const { return size == 0; }
+	//! Drops all data, keeps memory.
+	inline void clear() { head = size = 0; }
+	
+	/*!
+		\brief allocates memory for the given number of bytes, keeps data
+		\param[in] c new capacity, buffer never shrinks
+	*/
+	void set_capacity(size_t c);
+	//! Ensures that n bytes could be pushed without allocation
+	inline void reserve(size_t n) { if (size + n > capacity) grow(size + n); }
+	
+	/*!
+		\brief returns contiguous data span
+		\param[in] offset offset from the front of the buffer
+		\param[out] n number of bytes in the span
+	*/
+	const void *get_span(size_t offset, size_t &n) const;
+	/*!
+		\brief returns contiguous free space after the last byte. Use push(n) to commit written data.
+		\param[out] n number of bytes in the span
+	*/
+	void *get_free_span(size_t &n);
+	
+	//! Commits n bytes written to the free span
+	void push(size_t n);
+	//! Copies data to the end of the buffer, grows if needed
+	void push(const void *data, size_t n);
+	//! Copies n bytes starting at offset to dst
+	void peek(void *dst, size_t offset, size_t n) const;
+	//! Drops n bytes from the front
+	void pop(size_t n);
+	
+private: 
+	void grow(size_t c);
+	
+	unsigned char *ptr;
+	size_t capacity, head, size;
+};
+
+}
+
+#endif
@@ -25,18 +25,21 @@
 #include "buffer.h"
 #include "sample.h"
 #include <assert.h>
+#include <string.h>
 #include "clunk_assert.h"
-
-#if defined _MSC_VER || __APPLE__ || __FreeBSD__
-#	define pow10f(x) powf(10.0f, (x))
-#	define log2f(x) (logf(x) / M_LN2)
+#include "cpu_features.h"
+#include "kemar.h"
+#include "resampler.h"
+#ifdef CLUNK_USES_SSE
+#	include <xmmintrin.h>
+#endif
+#ifdef CLUNK_USES_AVX
+#	include <immintrin.h>
 #endif
 
 using namespace clunk;
 
-Source::mdct_type Source::mdct __attribute__ ((aligned (16)));
-
-clunk_static_assert(Source::WINDOW_BITS > 2);
+clunk_static_assert(Source::PARTITIONS * Source::PARTITION_SIZE == 512);
 
 template <typename T> inline T clunk_min(T a, T b) {
 	return a < b? a: b;
@@ -46,15 +49,420 @@ template <typename T> inline T clunk_max(T a, T b) {
 	return a > b? a: b;
 }
 
+//windowed sinc kernel: half-width in zero crossings and table resolution per unit
+enum { SINC_RADIUS = 4, SINC_STEPS = 256 };
+//taps of the widest kernel: cutoff is lowered down to 1/4 when pitching up
+enum { SINC_MAX_TAPS = 2 * SINC_RADIUS * 4 };
+
+static float sinc_table[SINC_RADIUS * SINC_STEPS + 2];
+
+static void build_sinc_table() {
+	for(int i = 0; i <= SINC_RADIUS * SINC_STEPS; ++i) {
+		double x = (double)i / SINC_STEPS;
+		double s = (i == 0)? 1: ((i % SINC_STEPS) == 0)? 0: sin(M_PI * x) / (M_PI * x);
+		double w = 0.42 + 0.5 * cos(M_PI * x / SINC_RADIUS) + 0.08 * cos(2 * M_PI * x / SINC_RADIUS); //blackman
+		sinc_table[i] = (float)(s * w);
+	}
+	sinc_table[SINC_RADIUS * SINC_STEPS + 1] = 0;
+}
+
+typedef const float (*kemar_table)[2][512];
+
+static const kemar_table kemar_elevations[] = {
+	elev_m40, elev_m30, elev_m20, elev_m10, elev_0, elev_10, elev_20, elev_30, elev_40, elev_50, elev_60, elev_70, elev_80, elev_90, 
+};
+
+static const int kemar_angles[] = {
+	ELEV_M40_N, ELEV_M30_N, ELEV_M20_N, ELEV_M10_N, ELEV_0_N, ELEV_10_N, ELEV_20_N, ELEV_30_N, ELEV_40_N, ELEV_50_N, ELEV_60_N, ELEV_70_N, ELEV_80_N, ELEV_90_N, 
+};
+
+enum { KEMAR_ELEVATIONS = sizeof(kemar_angles) / sizeof(kemar_angles[0]) };
+enum { KEMAR_TOTAL_ANGLES = ELEV_M40_N + ELEV_M30_N + ELEV_M20_N + ELEV_M10_N + ELEV_0_N + ELEV_10_N + ELEV_20_N + ELEV_30_N + ELEV_40_N + ELEV_50_N + ELEV_60_N + ELEV_70_N + ELEV_80_N + ELEV_90_N };
+enum { HRIR_SPECTRA_SIZE = 2 * Source::PARTITIONS * 2 * Source::PARTITION_SIZE };
+
+/*!
+	kemar impulse responses of all elevations split into partitions and transformed to frequency domain. 
+	every angle holds [ear][partition][re, im][bin] half spectra in the same packing as the input blocks, 
+	scaled by 1 / FFT_SIZE, so the inverse transform yields the convolution.
+*/
+static float hrir_spectra[KEMAR_TOTAL_ANGLES * HRIR_SPECTRA_SIZE];
+
+static void build_hrir_spectra() {
+	enum { B = Source::PARTITION_SIZE, N = Source::FFT_SIZE };
+	const Source::fft_type &fft = Source::fft_type::get_shared();
+	const float scale = 1.0f / N;
+	float *dst = hrir_spectra;
+	for(int e = 0; e < KEMAR_ELEVATIONS; ++e) {
+		for(int a = 0; a < kemar_angles[e]; ++a) {
+			for(int p = 0; p < Source::PARTITIONS; ++p) {
+				//left ear in the real part, right one in the imaginary, both zero-padded to the transform size
+				std::complex<float> z[N];
+				for(int i = 0; i < N; ++i) {
+					z[i] = i < B? std::complex<float>(kemar_elevations[e][a][0][p * B + i], kemar_elevations[e][a][1][p * B + i]): 0;
+				}
+				fft.apply<1>(z);
+				
+				float *l_re = dst + p * 2 * B, *l_im = l_re + B, *r_re = dst + (Source::PARTITIONS + p) * 2 * B, *r_im = r_re + B;
+				l_re[0] = z[0].real() * scale;
+				l_im[0] = z[B].real() * scale;
+				r_re[0] = z[0].imag() * scale;
+				r_im[0] = z[B].imag() * scale;
+				for(int k = 1; k < B; ++k) {
+					const std::complex<float> zk = z[k], zc = std::conj(z[N - k]);
+					l_re[k] = (zk + zc).real() * scale / 2;
+					l_im[k] = (zk + zc).imag() * scale / 2;
+					r_re[k] = (zk - zc).imag() * scale / 2;
+					r_im[k] = -(zk - zc).real() * scale / 2;
+				}
+			}
+			dst += HRIR_SPECTRA_SIZE;
+		}
+	}
+}
+
+static const float * get_hrir_spectra(kemar_table kemar_data, int kemar_idx) {
+	int offset = 0;
+	for(int e = 0; e < KEMAR_ELEVATIONS; ++e) {
+		if (kemar_elevations[e] == kemar_data) {
+			assert(kemar_idx >= 0 && kemar_idx < kemar_angles[e]);
+			return hrir_spectra + (offset + kemar_idx) * HRIR_SPECTRA_SIZE;
+		}
+		offset += kemar_angles[e];
+	}
+	return NULL;
+}
+
+/*
+	batched transforms of the hrtf: every row of the FFT_LANES lanes is one sse register, wider kernels take 
+	the rows of the adjacent butterflies at once. they do the same operations in the same order as fft_core::apply_batch.
+*/
+#ifdef CLUNK_USES_SSE
+clunk_static_assert(Source::FFT_LANES == 4);
+clunk_static_assert((Source::PARTITION_BITS + 1) % 2 == 0);
+
+//fft_core twiddles, every value repeated for all lanes
+static float batch_twiddle_re[Source::FFT_SIZE * Source::FFT_LANES], batch_twiddle_im[Source::FFT_SIZE * Source::FFT_LANES];
+
+//bit-reverse permutation and the first radix-4 pass, which has no twiddles
+template<int SIGN>
+static inline void fft_first_pass_sse(float *re, float *im) {
+	const Source::fft_type &core = Source::fft_type::get_shared();
+	const unsigned *swap_a = core.get_swap_a(), *swap_b = core.get_swap_b();
+	for(unsigned i = 0; i < core.get_swaps(); ++i) {
+		float *a_re = re + swap_a[i] * 4, *a_im = im + swap_a[i] * 4, *b_re = re + swap_b[i] * 4, *b_im = im + swap_b[i] * 4;
+		__m128 t_re = _mm_loadu_ps(a_re), t_im = _mm_loadu_ps(a_im);
+		_mm_storeu_ps(a_re, _mm_loadu_ps(b_re));
+		_mm_storeu_ps(a_im, _mm_loadu_ps(b_im));
+		_mm_storeu_ps(b_re, t_re);
+		_mm_storeu_ps(b_im, t_im);
+	}
+	
+	for(int i = 0; i < Source::FFT_SIZE * 4; i += 16) {
+		__m128 x0_re = _mm_loadu_ps(re + i), x1_re = _mm_loadu_ps(re + i + 4), x2_re = _mm_loadu_ps(re + i + 8), x3_re = _mm_loadu_ps(re + i + 12);
+		__m128 x0_im = _mm_loadu_ps(im + i), x1_im = _mm_loadu_ps(im + i + 4), x2_im = _mm_loadu_ps(im + i + 8), x3_im = _mm_loadu_ps(im + i + 12);
+		__m128 t0_re = _mm_add_ps(x0_re, x1_re), t0_im = _mm_add_ps(x0_im, x1_im);
+		__m128 t1_re = _mm_sub_ps(x0_re, x1_re), t1_im = _mm_sub_ps(x0_im, x1_im);
+		__m128 t2_re = _mm_add_ps(x2_re, x3_re), t2_im = _mm_add_ps(x2_im, x3_im);
+		//(x2 - x3) * -i * SIGN
+		__m128 t3_re = SIGN > 0? _mm_sub_ps(x2_im, x3_im): _mm_sub_ps(x3_im, x2_im);
+		__m128 t3_im = SIGN > 0? _mm_sub_ps(x3_re, x2_re): _mm_sub_ps(x2_re, x3_re);
+		_mm_storeu_ps(re + i, _mm_add_ps(t0_re, t2_re)); _mm_storeu_ps(im + i, _mm_add_ps(t0_im, t2_im));
+		_mm_storeu_ps(re + i + 4, _mm_add_ps(t1_re, t3_re)); _mm_storeu_ps(im + i + 4, _mm_add_ps(t1_im, t3_im));
+		_mm_storeu_ps(re + i + 8, _mm_sub_ps(t0_re, t2_re)); _mm_storeu_ps(im + i + 8, _mm_sub_ps(t0_im, t2_im));
+		_mm_storeu_ps(re + i + 12, _mm_sub_ps(t1_re, t3_re)); _mm_storeu_ps(im + i + 12, _mm_sub_ps(t1_im, t3_im));
+	}
+}
+
+//x * w, conjugated twiddle for the inverse transform
+template<int SIGN>
+static inline void rotate_sse(__m128 &x_re, __m128 &x_im, const float *w_re, const float *w_im) {
+	__m128 wr = _mm_loadu_ps(w_re), wi = _mm_loadu_ps(w_im);
+	__m128 a = _mm_mul_ps(x_re, wr), b = _mm_mul_ps(x_im, wi), c = _mm_mul_ps(x_im, wr), d = _mm_mul_ps(x_re, wi);
+	x_re = SIGN > 0? _mm_sub_ps(a, b): _mm_add_ps(a, b);
+	x_im = SIGN > 0? _mm_add_ps(c, d): _mm_sub_ps(c, d);
+}
+
+//radix-4 butterfly of the rows x, x + stride, x + 2 * stride, x + 3 * stride, twiddles of the pass are w_stride apart
+template<int SIGN>
+static inline void butterfly4_sse(float *re, float *im, unsigned stride, const float *w_re, const float *w_im, unsigned w_stride) {
+	__m128 x0_re = _mm_loadu_ps(re), x1_re = _mm_loadu_ps(re + stride), x2_re = _mm_loadu_ps(re + 2 * stride), x3_re = _mm_loadu_ps(re + 3 * stride);
+	__m128 x0_im = _mm_loadu_ps(im), x1_im = _mm_loadu_ps(im + stride), x2_im = _mm_loadu_ps(im + 2 * stride), x3_im = _mm_loadu_ps(im + 3 * stride);
+	rotate_sse<SIGN>(x2_re, x2_im, w_re, w_im);
+	rotate_sse<SIGN>(x1_re, x1_im, w_re + w_stride, w_im + w_stride);
+	rotate_sse<SIGN>(x3_re, x3_im, w_re + 2 * w_stride, w_im + 2 * w_stride);
+	
+	__m128 t0_re = _mm_add_ps(x0_re, x1_re), t0_im = _mm_add_ps(x0_im, x1_im);
+	__m128 t1_re = _mm_sub_ps(x0_re, x1_re), t1_im = _mm_sub_ps(x0_im, x1_im);
+	__m128 t2_re = _mm_add_ps(x2_re, x3_re), t2_im = _mm_add_ps(x2_im, x3_im);
+	__m128 t3_re = SIGN > 0? _mm_sub_ps(x2_im, x3_im): _mm_sub_ps(x3_im, x2_im);
+	__m128 t3_im = SIGN > 0? _mm_sub_ps(x3_re, x2_re): _mm_sub_ps(x2_re, x3_re);
+	_mm_storeu_ps(re, _mm_add_ps(t0_re, t2_re)); _mm_storeu_ps(im, _mm_add_ps(t0_im, t2_im));
+	_mm_storeu_ps(re + stride, _mm_add_ps(t1_re, t3_re)); _mm_storeu_ps(im + stride, _mm_add_ps(t1_im, t3_im));
+	_mm_storeu_ps(re + 2 * stride, _mm_sub_ps(t0_re, t2_re)); _mm_storeu_ps(im + 2 * stride, _mm_sub_ps(t0_im, t2_im));
+	_mm_storeu_ps(re + 3 * stride, _mm_sub_ps(t1_re, t3_re)); _mm_storeu_ps(im + 3 * stride, _mm_sub_ps(t1_im, t3_im));
+}
+
+template<int SIGN>
+static void fft_batch_sse(float *re, float *im) {
+	fft_first_pass_sse<SIGN>(re, im);
+	const float *w_re = batch_twiddle_re, *w_im = batch_twiddle_im;
+	for(unsigned l = 16; l <= Source::FFT_SIZE; l <<= 2) {
+		const unsigned l4 = l / 4, stride = l4 * 4;
+		for(unsigned base = 0; base < Source::FFT_SIZE; base += l) {
+			for(unsigned k = 0; k < l4; ++k) {
+				const unsigned i = (base + k) * 4;
+				butterfly4_sse<SIGN>(re + i, im + i, stride, w_re + k * 4, w_im + k * 4, stride);
+			}
+		}
+		w_re += 3 * stride;
+		w_im += 3 * stride;
+	}
+}
+#endif
+
+#ifdef CLUNK_USES_AVX
+//two adjacent butterflies of the pass at once
+template<int SIGN>
+static inline CLUNK_TARGET("avx") void rotate_avx(__m256 &x_re, __m256 &x_im, const float *w_re, const float *w_im) {
+	__m256 wr = _mm256_loadu_ps(w_re), wi = _mm256_loadu_ps(w_im);
+	__m256 a = _mm256_mul_ps(x_re, wr), b = _mm256_mul_ps(x_im, wi), c = _mm256_mul_ps(x_im, wr), d = _mm256_mul_ps(x_re, wi);
+	x_re = SIGN > 0? _mm256_sub_ps(a, b): _mm256_add_ps(a, b);
+	x_im = SIGN > 0? _mm256_add_ps(c, d): _mm256_sub_ps(c, d);
+}
+
+template<int SIGN>
+static inline CLUNK_TARGET("avx") void butterfly4_avx(float *re, float *im, unsigned stride, const float *w_re, const float *w_im, unsigned w_stride) {
+	__m256 x0_re = _mm256_loadu_ps(re), x1_re = _mm256_loadu_ps(re + stride), x2_re = _mm256_loadu_ps(re + 2 * stride), x3_re = _mm256_loadu_ps(re + 3 * stride);
+	__m256 x0_im = _mm256_loadu_ps(im), x1_im = _mm256_loadu_ps(im + stride), x2_im = _mm256_loadu_ps(im + 2 * stride), x3_im = _mm256_loadu_ps(im + 3 * stride);
+	rotate_avx<SIGN>(x2_re, x2_im, w_re, w_im);
+	rotate_avx<SIGN>(x1_re, x1_im, w_re + w_stride, w_im + w_stride);
+	rotate_avx<SIGN>(x3_re, x3_im, w_re + 2 * w_stride, w_im + 2 * w_stride);
+	
+	__m256 t0_re = _mm256_add_ps(x0_re, x1_re), t0_im = _mm256_add_ps(x0_im, x1_im);
+	__m256 t1_re = _mm256_sub_ps(x0_re, x1_re), t1_im = _mm256_sub_ps(x0_im, x1_im);
+	__m256 t2_re = _mm256_add_ps(x2_re, x3_re), t2_im = _mm256_add_ps(x2_im, x3_im);
+	__m256 t3_re = SIGN > 0? _mm256_sub_ps(x2_im, x3_im): _mm256_sub_ps(x3_im, x2_im);
+	__m256 t3_im = SIGN > 0? _mm256_sub_ps(x3_re, x2_re): _mm256_sub_ps(x2_re, x3_re);
+	_mm256_storeu_ps(re, _mm256_add_ps(t0_re, t2_re)); _mm256_storeu_ps(im, _mm256_add_ps(t0_im, t2_im));
+	_mm256_storeu_ps(re + stride, _mm256_add_ps(t1_re, t3_re)); _mm256_storeu_ps(im + stride, _mm256_add_ps(t1_im, t3_im));
+	_mm256_storeu_ps(re + 2 * stride, _mm256_sub_ps(t0_re, t2_re)); _mm256_storeu_ps(im + 2 * stride, _mm256_sub_ps(t0_im, t2_im));
+	_mm256_storeu_ps(re + 3 * stride, _mm256_sub_ps(t1_re, t3_re)); _mm256_storeu_ps(im + 3 * stride, _mm256_sub_ps(t1_im, t3_im));
+}
+
+template<int SIGN>
+static CLUNK_TARGET("avx") void fft_batch_avx(float *re, float *im) {
+	fft_first_pass_sse<SIGN>(re, im);
+	const float *w_re = batch_twiddle_re, *w_im = batch_twiddle_im;
+	for(unsigned l = 16; l <= Source::FFT_SIZE; l <<= 2) {
+		const unsigned l4 = l / 4, stride = l4 * 4;
+		for(unsigned base = 0; base < Source::FFT_SIZE; base += l) {
+			for(unsigned k = 0; k < l4; k += 2) {
+				const unsigned i = (base + k) * 4;
+				butterfly4_avx<SIGN>(re + i, im + i, stride, w_re + k * 4, w_im + k * 4, stride);
+			}
+		}
+		w_re += 3 * stride;
+		w_im += 3 * stride;
+	}
+}
+
+//four adjacent butterflies of the pass at once, passes after the first one have at least four
+template<int SIGN>
+static inline CLUNK_TARGET("avx512f") void rotate_avx512(__m512 &x_re, __m512 &x_im, const float *w_re, const float *w_im) {
+	__m512 wr = _mm512_loadu_ps(w_re), wi = _mm512_loadu_ps(w_im);
+	__m512 a = _mm512_mul_ps(x_re, wr), b = _mm512_mul_ps(x_im, wi), c = _mm512_mul_ps(x_im, wr), d = _mm512_mul_ps(x_re, wi);
+	x_re = SIGN > 0? _mm512_sub_ps(a, b): _mm512_add_ps(a, b);
+	x_im = SIGN > 0? _mm512_add_ps(c, d): _mm512_sub_ps(c, d);
+}
+
+template<int SIGN>
+static inline CLUNK_TARGET("avx512f") void butterfly4_avx512(float *re, float *im, unsigned stride, const float *w_re, const float *w_im, unsigned w_stride) {
+	__m512 x0_re = _mm512_loadu_ps(re), x1_re = _mm512_loadu_ps(re + stride), x2_re = _mm512_loadu_ps(re + 2 * stride), x3_re = _mm512_loadu_ps(re + 3 * stride);
+	__m512 x0_im = _mm512_loadu_ps(im), x1_im = _mm512_loadu_ps(im + stride), x2_im = _mm512_loadu_ps(im + 2 * stride), x3_im = _mm512_loadu_ps(im + 3 * stride);
+	rotate_avx512<SIGN>(x2_re, x2_im, w_re, w_im);
+	rotate_avx512<SIGN>(x1_re, x1_im, w_re + w_stride, w_im + w_stride);
+	rotate_avx512<SIGN>(x3_re, x3_im, w_re + 2 * w_stride, w_im + 2 * w_stride);
+	
+	__m512 t0_re = _mm512_add_ps(x0_re, x1_re), t0_im = _mm512_add_ps(x0_im, x1_im);
+	__m512 t1_re = _mm512_sub_ps(x0_re, x1_re), t1_im = _mm512_sub_ps(x0_im, x1_im);
+	__m512 t2_re = _mm512_add_ps(x2_re, x3_re), t2_im = _mm512_add_ps(x2_im, x3_im);
+	__m512 t3_re = SIGN > 0? _mm512_sub_ps(x2_im, x3_im): _mm512_sub_ps(x3_im, x2_im);
+	__m512 t3_im = SIGN > 0? _mm512_sub_ps(x3_re, x2_re): _mm512_sub_ps(x2_re, x3_re);
+	_mm512_storeu_ps(re, _mm512_add_ps(t0_re, t2_re)); _mm512_storeu_ps(im, _mm512_add_ps(t0_im, t2_im));
+	_mm512_storeu_ps(re + stride, _mm512_add_ps(t1_re, t3_re)); _mm512_storeu_ps(im + stride, _mm512_add_ps(t1_im, t3_im));
+	_mm512_storeu_ps(re + 2 * stride, _mm512_sub_ps(t0_re, t2_re)); _mm512_storeu_ps(im + 2 * stride, _mm512_sub_ps(t0_im, t2_im));
+	_mm512_storeu_ps(re + 3 * stride, _mm512_sub_ps(t1_re, t3_re)); _mm512_storeu_ps(im + 3 * stride, _mm512_sub_ps(t1_im, t3_im));
+}
+
+template<int SIGN>
+static CLUNK_TARGET("avx512f") void fft_batch_avx512(float *re, float *im) {
+	fft_first_pass_sse<SIGN>(re, im);
+	const float *w_re = batch_twiddle_re, *w_im = batch_twiddle_im;
+	for(unsigned l = 16; l <= Source::FFT_SIZE; l <<= 2) {
+		const unsigned l4 = l / 4, stride = l4 * 4;
+		for(unsigned base = 0; base < Source::FFT_SIZE; base += l) {
+			for(unsigned k = 0; k < l4; k += 4) {
+				const unsigned i = (base + k) * 4;
+				butterfly4_avx512<SIGN>(re + i, im + i, stride, w_re + k * 4, w_im + k * 4, stride);
+			}
+		}
+		w_re += 3 * stride;
+		w_im += 3 * stride;
+	}
+}
+#endif
+
+static void build_batch_twiddles() {
+#ifdef CLUNK_USES_SSE
+	Source::fft_type::get_shared().expand_twiddles<Source::FFT_LANES>(batch_twiddle_re, batch_twiddle_im);
+#endif
+}
+
+//FFT_LANES transforms of the scratch, uses the widest kernel reported by cpu_features
+template<int SIGN>
+static void fft_batch(Source::hrtf_scratch &scratch) {
+	float *re = scratch.re[0], *im = scratch.im[0];
+#ifdef CLUNK_USES_AVX
+	if (cpu_features::has(cpu_features::AVX512F)) {
+		fft_batch_avx512<SIGN>(re, im);
+		return;
+	}
+	if (cpu_features::has(cpu_features::AVX)) {
+		fft_batch_avx<SIGN>(re, im);
+		return;
+	}
+#endif
+#ifdef CLUNK_USES_SSE
+	if (cpu_features::has(cpu_features::SSE2)) {
+		fft_batch_sse<SIGN>(re, im);
+		return;
+	}
+#endif
+	Source::fft_type::get_shared().apply_batch<SIGN, Source::FFT_LANES>(re, im);
+}
+
+namespace {
+	//used when the whole fetched range lies within the sample
+	struct direct_reader {
+		const Sint16 *src;
+		int ch;
+		inline float operator()(int p) const { return src[p * ch]; }
+	};
+
+	//handles looping and reading past the sample bounds
+	struct wrapping_reader {
+		const Sint16 *src;
+		int ch, n;
+		bool loop;
+		inline float operator()(int p) const {
+			if (!loop && (p < 0 || p >= n))
+				return 0;
+			p %= n;
+			if (p < 0)
+				p += n;
+			return src[p * ch];
+		}
+	};
+}
+
+template<typename reader_type>
+static void interpolate(float *dst, int n, double start, float step, const reader_type &read, Source::Interpolation mode, int radius, float cutoff) {
+	switch(mode) {
+	case Source::Linear: 
+		for(int i = 0; i < n; ++i) {
+			double pos = start + (double)i * step;
+			int p = (int)floor(pos);
+			float f = (float)(pos - p);
+			float p1 = read(p), p2 = read(p + 1);
+			dst[i] = p1 + f * (p2 - p1);
+		}
+		break;
+
+	case Source::Cubic: 
+		for(int i = 0; i < n; ++i) {
+			double pos = start + (double)i * step;
+			int p = (int)floor(pos);
+			float f = (float)(pos - p);
+			float p0 = read(p - 1), p1 = read(p), p2 = read(p + 1), p3 = read(p + 2);
+			//catmull-rom
+			dst[i] = p1 + 0.5f * f * (p2 - p0 + f * (2 * p0 - 5 * p1 + 4 * p2 - p3 + f * (3 * (p1 - p2) + p3 - p0)));
+		}
+		break;
+
+	case Source::Sinc: {
+		const float *table = sinc_table;
+		const float scale = cutoff * SINC_STEPS;
+		//taps and samples are padded with zeros to a multiple of 4 for Resampler::convolve
+		const int taps = 2 * radius, padded_taps = (taps + 3) & ~3;
+		assert(padded_taps <= SINC_MAX_TAPS);
+		float w[SINC_MAX_TAPS], x[SINC_MAX_TAPS];
+		for(int k = taps; k < padded_taps; ++k) {
+			w[k] = x[k] = 0;
+		}
+		for(int i = 0; i < n; ++i) {
+			double pos = start + (double)i * step;
+			int p = (int)floor(pos);
+			float f = (float)(pos - p);
+			float norm = 0;
+			for(int k = 0; k < taps; ++k) {
+				float d = fabsf(k + 1 - radius - f) * scale;
+				int di = (int)d;
+				w[k] = (di < SINC_RADIUS * SINC_STEPS)? table[di] + (d - di) * (table[di + 1] - table[di]): 0;
+				x[k] = read(p + k + 1 - radius);
+				norm += w[k];
+			}
+			dst[i] = norm != 0? Resampler::convolve(x, w, padded_taps) / norm: 0;
+		}
+	}
+	break;
+	}
+}
+
+void Source::fetch(float *dst, int n, double start, float step, const Sint16 *src, int src_ch, int src_n, int channel) const {
+	if (n <= 0)
+		return;
+	//lowering cutoff frequency when pitching up, so the kernel stretches over more taps
+	float cutoff = (step > 1)? clunk_max(0.25f, 1 / step): 1.0f;
+	int radius = 0;
+	switch(interpolation) {
+	case Linear: radius = 1; break;
+	case Cubic: radius = 2; break;
+	case Sinc: radius = (int)ceilf(SINC_RADIUS / cutoff); break;
+	}
+	double end = start + (double)(n - 1) * step;
+	if (floor(start) - radius + 1 >= 0 && floor(end) + radius < src_n) {
+		direct_reader r = { src + channel, src_ch };
+		interpolate(dst, n, start, step, r, interpolation, radius, cutoff);
+	} else {
+		wrapping_reader r = { src + channel, src_ch, src_n, loop };
+		interpolate(dst, n, start, step, r, interpolation, radius, cutoff);
+	}
+}
+
+void Source::_init_tables() {
+	//tables never change once built, so building them again from another context is harmless
+	static bool built = false;
+	if (built)
+		return;
+	build_sinc_table();
+	build_hrir_spectra();
+	build_batch_twiddles();
+	built = true;
+}
+
 Source::Source(const Sample * sample, const bool loop, const v3<float> &delta, float gain, float pitch, float panning) : 
-	sample(sample), loop(loop), delta_position(delta), gain(gain), pitch(pitch), panning(panning), 
-	position(0), fadeout(0), fadeout_total(0)
+	sample(sample), loop(loop), delta_position(delta), gain(gain), pitch(pitch), panning(panning), interpolation(Linear), 
+	position(0), fadeout(0), fadeout_total(0), fraction(0), rendered_position(0)
 	{
-	for(int i = 0; i < 2; ++i) {
-		for(int j = 0; j < WINDOW_SIZE / 2; ++j) {
-			overlap_data[i][j] = 0;
+	for(int i = 0; i < PARTITION_SIZE; ++i) {
+		input_tail[i] = 0;
+	}
+	for(int p = 0; p < PARTITIONS; ++p) {
+		for(int i = 0; i < PARTITION_SIZE; ++i) {
+			spectrum_re[p][i] = spectrum_im[p][i] = 0;
 		}
 	}
+	spectrum_pos = 0;
 	
 	if (sample == NULL)
 		throw_ex(("sample for source cannot be NULL"));
@@ -73,141 +481,197 @@ bool Source::playing() const {
 	return position < (int)(sample->data.get_size() / sample->spec.channels / 2);
 }
 	
-void Source::idt_iit(const v3<float> &delta, const v3<float> &dir_vec, float &idt_offset, float &angle_gr, float &left_to_right_amp) {
-	float head_r = 0.093f;
-
+float Source::azimuth(const v3<float> &delta, const v3<float> &dir_vec) {
 	float direction = dir_vec.is0()? float(M_PI_2): (float)atan2f(dir_vec.y, dir_vec.x);
 	float angle = direction - atan2f(delta.y, delta.x);
 	
-	angle_gr = angle * 180 / float(M_PI);
+	float angle_gr = angle * 180 / float(M_PI);
 	while (angle_gr < 0)
 		angle_gr += 360;
 	
 	//LOG_DEBUG(("relative position = (%g,%g,%g), angle = %g (%g)", delta.x, delta.y, delta.z, angle, angle_gr));
+	return angle_gr;
+}
+
+void Source::analyze(hrtf_scratch &scratch, int blocks, double start, float pitch, const Sint16 *src, int src_ch, int src_n) {
+	assert(blocks > 0 && blocks <= 2 * FFT_LANES);
+	const int n = blocks * PARTITION_SIZE;
+	float *input = scratch.input;
+	memcpy(input, input_tail, sizeof(input_tail));
+	fetch(input + PARTITION_SIZE, n, start, pitch, src, src_ch, src_n, 0);
+	if (fadeout_total > 0) {
+		//fadeout counts source samples from the current position
+		double ahead = start - (position + fraction);
+		if (ahead < 0)
+			ahead += src_n;
+		for(int i = 0; i < n; ++i) {
+			float left = (float)(fadeout - ahead - (double)i * pitch);
+			input[PARTITION_SIZE + i] = left > 0? input[PARTITION_SIZE + i] * left / fadeout_total: 0;
+		}
+	}
+	memcpy(input_tail, input + n, sizeof(input_tail));
 	
-	float idt_angle = fmodf(angle, 2 * (float)M_PI);
+	//overlap-save: every block is transformed together with the previous one. 
+	//blocks are real, so every lane holds two of them, one in the real part and the other in the imaginary
+	for(int l = 0; l < FFT_LANES; ++l) {
+		const float *a = input + 2 * l * PARTITION_SIZE, *b = a + PARTITION_SIZE;
+		for(int i = 0; i < FFT_SIZE; ++i) {
+			scratch.re[i][l] = 2 * l < blocks? a[i]: 0;
+			scratch.im[i][l] = 2 * l + 1 < blocks? b[i]: 0;
+		}
+	}
+	fft_batch<1>(scratch);
+
+	//splitting spectra of the lanes, only the first half of the real block spectrum is kept
+	for(int l = 0; 2 * l < blocks; ++l) {
+		float *a_re = scratch.block_re[2 * l], *a_im = scratch.block_im[2 * l], *b_re = scratch.block_re[2 * l + 1], *b_im = scratch.block_im[2 * l + 1];
+		a_re[0] = scratch.re[0][l];
+		a_im[0] = scratch.re[PARTITION_SIZE][l];
+		b_re[0] = scratch.im[0][l];
+		b_im[0] = scratch.im[PARTITION_SIZE][l];
+		for(int k = 1; k < PARTITION_SIZE; ++k) {
+			const float z_re = scratch.re[k][l], z_im = scratch.im[k][l], c_re = scratch.re[FFT_SIZE - k][l], c_im = scratch.im[FFT_SIZE - k][l];
+			a_re[k] = (z_re + c_re) / 2;
+			a_im[k] = (z_im - c_im) / 2;
+			b_re[k] = (z_im + c_im) / 2;
+			b_im[k] = (c_re - z_re) / 2;
+		}
+	}
+}
 
-	if (idt_angle < 0)
-		idt_angle += 2 * (float)M_PI;
-	if (idt_angle >= float(M_PI_2) && idt_angle < (float)M_PI) {
-		idt_angle = float(M_PI) - idt_angle;
-	} else if (idt_angle >= float(M_PI) && idt_angle < 3 * float(M_PI_2)) {
-		idt_angle = (float)M_PI - idt_angle;
-	} else if (idt_angle >= 3 * (float)M_PI_2) {
-		idt_angle -= (float)M_PI * 2;
+clunk_static_assert(Source::PARTITION_SIZE % 16 == 0);
+
+#ifdef CLUNK_USES_AVX
+static CLUNK_TARGET("avx") void multiply_add_avx(float *r_re, float *r_im, const float *x_re, const float *x_im, const float *h_re, const float *h_im, int n) {
+	for(int k = 0; k < n; k += 8) {
+		__m256 xr = _mm256_loadu_ps(x_re + k), xi = _mm256_loadu_ps(x_im + k), hr = _mm256_loadu_ps(h_re + k), hi = _mm256_loadu_ps(h_im + k);
+		_mm256_storeu_ps(r_re + k, _mm256_add_ps(_mm256_loadu_ps(r_re + k), _mm256_sub_ps(_mm256_mul_ps(xr, hr), _mm256_mul_ps(xi, hi))));
+		_mm256_storeu_ps(r_im + k, _mm256_add_ps(_mm256_loadu_ps(r_im + k), _mm256_add_ps(_mm256_mul_ps(xr, hi), _mm256_mul_ps(xi, hr))));
 	}
+}
 
-	//LOG_DEBUG(("idt_angle = %g (%d)", idt_angle, (int)(idt_angle * 180 / M_PI)));
-	idt_offset = - head_r * (idt_angle + sin(idt_angle)) / 344;
-	left_to_right_amp = pow10f(-sin(idt_angle));
-	//LOG_DEBUG(("idt_offset %g, left_to_right_amp: %g", idt_offset, left_to_right_amp));
+static CLUNK_TARGET("avx512f") void multiply_add_avx512(float *r_re, float *r_im, const float *x_re, const float *x_im, const float *h_re, const float *h_im, int n) {
+	for(int k = 0; k < n; k += 16) {
+		__m512 xr = _mm512_loadu_ps(x_re + k), xi = _mm512_loadu_ps(x_im + k), hr = _mm512_loadu_ps(h_re + k), hi = _mm512_loadu_ps(h_im + k);
+		_mm512_storeu_ps(r_re + k, _mm512_add_ps(_mm512_loadu_ps(r_re + k), _mm512_sub_ps(_mm512_mul_ps(xr, hr), _mm512_mul_ps(xi, hi))));
+		_mm512_storeu_ps(r_im + k, _mm512_add_ps(_mm512_loadu_ps(r_im + k), _mm512_add_ps(_mm512_mul_ps(xr, hi), _mm512_mul_ps(xi, hr))));
+	}
 }
+#endif
 
-void Source::hrtf(int window, const unsigned channel_idx, clunk::Buffer &result, const Sint16 *src, int src_ch, int src_n, int idt_offset, const kemar_ptr& kemar_data, int kemar_idx, float freq_decay) {
-	assert(channel_idx < 2);
-	
-	//LOG_DEBUG(("%d bytes, %d actual window size, %d windows", dst_n, CLUNK_ACTUAL_WINDOW, n));
-	//result.set_size(2 * WINDOW_SIZE / 2); //sizeof(Sint16) * window  / 2
-	size_t result_start = result.get_size();
-	result.reserve(WINDOW_SIZE);
-	
-	//LOG_DEBUG(("channel %d: window %d: adding %d, buffer size: %u, decay: %g", channel_idx, window, WINDOW_SIZE, (unsigned)result.get_size(), freq_decay));
-
-	if (channel_idx <= 1) {
-		bool left = channel_idx == 0;
-		if (!left && idt_offset > 0) {
-			idt_offset = 0;
-		} else if (left && idt_offset < 0) {
-			idt_offset = 0;
+//r += x * h over n complex bins stored as separate real and imaginary parts, n is a multiple of 16
+static void multiply_add(float *r_re, float *r_im, const float *x_re, const float *x_im, const float *h_re, const float *h_im, int n) {
+#ifdef CLUNK_USES_AVX
+	if (cpu_features::has(cpu_features::AVX512F)) {
+		multiply_add_avx512(r_re, r_im, x_re, x_im, h_re, h_im, n);
+		return;
+	}
+	if (cpu_features::has(cpu_features::AVX)) {
+		multiply_add_avx(r_re, r_im, x_re, x_im, h_re, h_im, n);
+		return;
+	}
+#endif
+#ifdef CLUNK_USES_SSE
+	if (cpu_features::has(cpu_features::SSE2)) {
+		for(int k = 0; k < n; k += 4) {
+			__m128 xr = _mm_loadu_ps(x_re + k), xi = _mm_loadu_ps(x_im + k), hr = _mm_loadu_ps(h_re + k), hi = _mm_loadu_ps(h_im + k);
+			_mm_storeu_ps(r_re + k, _mm_add_ps(_mm_loadu_ps(r_re + k), _mm_sub_ps(_mm_mul_ps(xr, hr), _mm_mul_ps(xi, hi))));
+			_mm_storeu_ps(r_im + k, _mm_add_ps(_mm_loadu_ps(r_im + k), _mm_add_ps(_mm_mul_ps(xr, hi), _mm_mul_ps(xi, hr))));
 		}
-		if (idt_offset < 0)
-			idt_offset = - idt_offset;
-	} else 
-		idt_offset = 0;
-
-	for(int i = 0; i < WINDOW_SIZE; ++i) {
-		//-1 0 1 2 3
-		int p = position + idt_offset + (int)((window * WINDOW_SIZE / 2 + i) * pitch); //overlapping half
-		//printf("%d of %d, ", p, src_n);
-		int v = 0;
-		if (fadeout_total > 0 && fadeout - i <= 0) {
-			//v = 0;
-		} else if (loop || (p >= 0 && p < src_n)) {
-			p %= src_n;
-			if (p < 0)
-				p += src_n;
-			v = src[p * src_ch];
+		return;
+	}
+#endif
+	for(int k = 0; k < n; ++k) {
+		r_re[k] += x_re[k] * h_re[k] - x_im[k] * h_im[k];
+		r_im[k] += x_re[k] * h_im[k] + x_im[k] * h_re[k];
+	}
+}
+
+void Source::hrtf(hrtf_scratch &scratch, int first, int blocks, const float *hrir) {
+	assert(blocks > 0 && blocks <= FFT_LANES);
+	for(int l = 0; l < blocks; ++l) {
+		spectrum_pos = (spectrum_pos + 1) % PARTITIONS;
+		memcpy(spectrum_re[spectrum_pos], scratch.block_re[first + l], sizeof(spectrum_re[0]));
+		memcpy(spectrum_im[spectrum_pos], scratch.block_im[first + l], sizeof(spectrum_im[0]));
+		
+		//sum of the delayed input spectra multiplied by the hrir partitions
+		float y_re[2][PARTITION_SIZE], y_im[2][PARTITION_SIZE];
+		for(int c = 0; c < 2; ++c) {
+			float *r_re = y_re[c], *r_im = y_im[c];
+			for(int k = 0; k < PARTITION_SIZE; ++k) {
+				r_re[k] = r_im[k] = 0;
+			}
+			float dc = 0, nyquist = 0;
+			for(int p = 0; p < PARTITIONS; ++p) {
+				const int slot = (spectrum_pos + PARTITIONS - p) % PARTITIONS;
+				const float *x_re = spectrum_re[slot], *x_im = spectrum_im[slot];
+				const float *h_re = hrir + (c * PARTITIONS + p) * 2 * PARTITION_SIZE, *h_im = h_re + PARTITION_SIZE;
+				dc += x_re[0] * h_re[0];
+				nyquist += x_im[0] * h_im[0];
+				multiply_add(r_re, r_im, x_re, x_im, h_re, h_im, PARTITION_SIZE);
+			}
+			r_re[0] = dc;
+			r_im[0] = nyquist;
 		}
-		//assert(v < 32768 && v > -32768);
-		if (fadeout_total > 0 && fadeout - i > 0) {
-			//LOG_DEBUG(("fadeout %d: %d -> %d", fadeout - i, v, v * (fadeout - i) / fadeout_total));
-			v *= (fadeout - i) / fadeout_total;
+		
+		//both ears are real, so they share one inverse transform: left ear in the real part, right one in the imaginary
+		scratch.re[0][l] = y_re[0][0];
+		scratch.im[0][l] = y_re[1][0];
+		scratch.re[PARTITION_SIZE][l] = y_im[0][0];
+		scratch.im[PARTITION_SIZE][l] = y_im[1][0];
+		for(int k = 1; k < PARTITION_SIZE; ++k) {
+			scratch.re[k][l] = y_re[0][k] - y_im[1][k];
+			scratch.im[k][l] = y_im[0][k] + y_re[1][k];
+			scratch.re[FFT_SIZE - k][l] = y_re[0][k] + y_im[1][k];
+			scratch.im[FFT_SIZE - k][l] = y_re[1][k] - y_im[0][k];
 		}
-		mdct.data[i] = v / 32768.0f;
-		//fprintf(stderr, "%g ", mdct.data[i]);
 	}
+	fft_batch<-1>(scratch);
 	
-	mdct.apply_window();
-	mdct.mdct();
-		
-	//LOG_DEBUG(("kemar angle index: %d\n", kemar_idx));
-	assert(freq_decay >= 1);
-	for(int i = 0; i < mdct_type::M; ++i) {
-		float v = mdct.data[i];
-		const int kemar_angle_idx = i * 512 / mdct_type::M;
-		const float decay = 1 + i * (freq_decay - 1) / mdct_type::M;
-		assert(kemar_angle_idx < 512);
-		float m = pow10f(-kemar_data[kemar_idx][0][kemar_angle_idx] * v / 20) / decay;
-
-		mdct.data[i] = v * m;
-		//fprintf(stderr, "%g d: %g", m, decay);
+	//first half of every transform is wrapped around, the second one is the convolution of the block
+	for(int l = 0; l < blocks; ++l) {
+		float result[2][PARTITION_SIZE];
+		for(int i = 0; i < PARTITION_SIZE; ++i) {
+			result[0][i] = scratch.re[PARTITION_SIZE + i][l];
+			result[1][i] = scratch.im[PARTITION_SIZE + i][l];
+		}
+		for(int c = 0; c < 2; ++c) {
+			sample3d[c].push(result[c], sizeof(result[c]));
+		}
 	}
-	
-	mdct.imdct();
-	mdct.apply_window();
-
-	Sint16 *dst = (Sint16 *)((unsigned char *)result.get_ptr() + result_start);
-
-	float max_v = 1.0f, min_v = -1.0f;
-	
-	for(int i = 0; i < WINDOW_SIZE / 2; ++i) {
-		float v = (mdct.data[i] + overlap_data[channel_idx][i]);
+}
 
-		if (v < min_v)
-			min_v = v;
-		else if (v > max_v)
-			max_v = v;
+void Source::_reserve(unsigned samples) {
+	//hrtf adds whole blocks until period is filled
+	for(int i = 0; i < 2; ++i) {
+		sample3d[i].set_capacity((samples + PARTITION_SIZE) * sizeof(float));
 	}
+}
 
-	{
-		//stupid msvc
-		int i;
-		for(i = 0; i < WINDOW_SIZE / 2; ++i) {
-			float v = ((mdct.data[i] + overlap_data[channel_idx][i]) - min_v) / (max_v - min_v) * 2 - 1;
-			
-			if (v < -1) {
-				LOG_DEBUG(("clipping %f [%f-%f]", v, min_v, max_v));
-				v = -1;
-			} else if (v > 1) {
-				LOG_DEBUG(("clipping %f [%f-%f]", v, min_v, max_v));
-				v = 1;
-			}
-			*dst++ = (int)(v * 32767);
-		}
-		for(; i < WINDOW_SIZE; ++i) {
-			overlap_data[channel_idx][i - WINDOW_SIZE / 2] = mdct.data[i];
-		}
+void Source::advance(float dp) {
+	float p = fraction + dp;
+	int n = (int)floorf(p);
+	fraction = p - n;
+	move(n);
+}
+
+void Source::consume(unsigned n, float pitch) {
+	for(int i = 0; i < 2; ++i) {
+		sample3d[i].pop(n * sizeof(float));
 	}
+	advance(n * pitch);
 }
 
 void Source::_update_position(const int dp) {
 	//LOG_DEBUG(("update_position(%d)", dp));
-	position += dp;
-	
 	for(int i = 0; i < 2; ++i) {
-		Buffer & buf = sample3d[i];
-		buf.pop(dp * 2);
+		sample3d[i].pop(dp * sizeof(float));
 	}
+	move(dp);
+}
+
+void Source::move(const int dp) {
+	position += dp;
 	
 	int src_n = (int)sample->data.get_size() / sample->spec.channels / 2;
 	if (loop) {
@@ -225,9 +689,7 @@ void Source::_update_position(const int dp) {
 	}
 }
 
-float Source::_process(clunk::Buffer &buffer, unsigned dst_ch, const v3<float> &delta_position, const v3<float> &direction, float fx_volume, float pitch) {
-	Sint16 * dst = (Sint16*) buffer.get_ptr();
-	unsigned dst_n = (unsigned)buffer.get_size() / dst_ch / 2;
+float Source::_process(float *dst, unsigned dst_n, unsigned dst_ch, const v3<float> &delta_position, const v3<float> &direction, float fx_volume, float pitch, hrtf_scratch &scratch) {
 	const Sint16 * src = (Sint16*) sample->data.get_ptr();
 	if (src == NULL)
 		throw_ex(("uninitialized sample used (%p)", (void *)sample));
@@ -245,7 +707,7 @@ float Source::_process(clunk::Buffer &buffer, unsigned dst_ch, const v3<float> &
 		vol = 1;
 
 	if (vol < 0 || (int)floor(SDL_MIX_MAXVOLUME * vol + 0.5f) <= 0) {
-		_update_position((int)(dst_n * pitch));
+		consume(dst_n, pitch);
 		return 0;
 	}
 	
@@ -255,84 +717,82 @@ float Source::_process(clunk::Buffer &buffer, unsigned dst_ch, const v3<float> &
 
 	if (delta_position.is0() || kemar_data == NULL) {
 		//2d stereo sound! 
-		for(unsigned i = 0; i < dst_n; ++i) {
+		float chunk[PARTITION_SIZE];
+		for(unsigned i0 = 0; i0 < dst_n; i0 += PARTITION_SIZE) {
+			unsigned n = clunk_min<unsigned>(PARTITION_SIZE, dst_n - i0);
 			for(unsigned c = 0; c < dst_ch; ++c) {
-				int p = position + (int)(i * pitch);
-			
-				Sint16 v = 0;
-				if (loop || (p >= 0 && p < (int)src_n)) {
-					p %= src_n;
-					if (p < 0)
-						p += src_n;
-					
-					if (c < src_ch) {
-						v = src[p * src_ch + c];
-					} else {
-						v = src[p * src_ch];//expand mono channel if needed
-					}
-
-					if (panning != 0 && c < 2) {
-						bool left = c == 0;
-						int v0 = (int)((1.0f + panning * (left? -1: 1)) * v);
-						if (v0 > 32767) {
-							v = 32767;
-						} else if (v0 < -32767) {
-							v = -32767;
-						} else {
-							v = (Sint16)v0;
-						}
-					}
+				//expand mono channel if needed
+				fetch(chunk, n, position + fraction + (double)i0 * pitch, pitch, src, src_ch, src_n, c < src_ch? c: 0);
+				float v = vol;
+				if (panning != 0 && c < 2) {
+					bool left = c == 0;
+					v *= 1.0f + panning * (left? -1: 1);
+				}
+				for(unsigned i = 0; i < n; ++i) {
+					dst[(i0 + i) * dst_ch + c] = chunk[i] * v;
 				}
-				dst[i * dst_ch + c] = v;
 			}
 		}
-		_update_position((int)(dst_n * pitch));
+		consume(dst_n, pitch);
 		return vol;
 	}
 	
 	//LOG_DEBUG(("data: %p, angles: %d", (void *) kemar_data, angles));
-	_update_position(0);
+	move(0);
 	
 	if (position >= (int)src_n) {
 		//LOG_ERROR(("process called on inactive source"));
 		return 0;
 	}
 
-	float t_idt, angle_gr, left_to_right_amp;
-	idt_iit(delta_position, direction, t_idt, angle_gr, left_to_right_amp);
-
-	const int kemar_idx_right = ((((int)angle_gr  + 180 / (int)angles)/ (360 / (int)angles)) % (int)angles);
-	const int kemar_idx_left = (((360 - (int)angle_gr - 180 / (int)angles) / (360 / (int)angles)) % (int)angles);
-	//LOG_DEBUG(("%g -> left: %d, right: %d", angle_gr, kemar_idx_left, kemar_idx_right));
+	const float angle_gr = azimuth(delta_position, direction);
+	//hrirs hold both interaural time and level differences, the same angle is used for both ears
+	const int kemar_idx = ((((int)angle_gr  + 180 / (int)angles)/ (360 / (int)angles)) % (int)angles);
+	//LOG_DEBUG(("%g -> %d", angle_gr, kemar_idx));
+	const float *hrir = get_hrir_spectra(kemar_data, kemar_idx);
+	assert(hrir != NULL);
+
+	//every block adds PARTITION_SIZE samples to both ears
+	assert(sample3d[0].get_size() == sample3d[1].get_size());
+	const unsigned rendered = (unsigned)(sample3d[0].get_size() / sizeof(float));
+	const int blocks = rendered < dst_n? (int)((dst_n - rendered + PARTITION_SIZE - 1) / PARTITION_SIZE): 0;
 	
-	int idt_offset = (int)(t_idt * sample->spec.freq);
-
-	int window = 0;
-	while(sample3d[0].get_size() < dst_n * 2 || sample3d[1].get_size() < dst_n * 2) {
-		hrtf(window, 0, sample3d[0], src, src_ch, src_n, idt_offset, kemar_data, kemar_idx_left, left_to_right_amp > 1? 1: 1 / left_to_right_amp);
-		hrtf(window, 1, sample3d[1], src, src_ch, src_n, idt_offset, kemar_data, kemar_idx_right, left_to_right_amp > 1? left_to_right_amp: 1);
-		++window;
+	//rendered output is in output samples, the source is read from where the previous block ended
+	if (rendered == 0)
+		rendered_position = position + fraction;
+	for(int block = 0; block < blocks; block += 2 * FFT_LANES) {
+		const int n = clunk_min<int>(2 * FFT_LANES, blocks - block);
+		analyze(scratch, n, rendered_position, pitch, src, src_ch, src_n);
+		rendered_position += (double)n * PARTITION_SIZE * pitch;
+		if (loop)
+			rendered_position = fmod(rendered_position, (double)src_n);
+		for(int b = 0; b < n; b += FFT_LANES) {
+			hrtf(scratch, b, clunk_min<int>(FFT_LANES, n - b), hrir);
+		}
 	}
-	assert(sample3d[0].get_size() >= dst_n * 2 && sample3d[1].get_size() >= dst_n * 2);
+	assert(sample3d[0].get_size() >= dst_n * sizeof(float) && sample3d[1].get_size() >= dst_n * sizeof(float));
 	
-	//LOG_DEBUG(("angle: %g", angle_gr));
-	//LOG_DEBUG(("idt offset %d samples", idt_offset));
-	Sint16 * src_3d[2] = { (Sint16 *)sample3d[0].get_ptr(), (Sint16 *)sample3d[1].get_ptr() };
-	
-	//LOG_DEBUG(("size1: %u, %u, needed: %u\n%s", (unsigned)sample3d[0].get_size(), (unsigned)sample3d[1].get_size(), dst_n, sample3d[0].dump().c_str()));
-	
-	for(unsigned i = 0; i < dst_n; ++i) {
-		for(unsigned c = 0; c < dst_ch; ++c) {
-			dst[i * dst_ch + c] = src_3d[c][i];
+	//rendered data could wrap around the end of the ring: samples before 'wrap' are in the head span, others in the tail one
+	for(unsigned c = 0; c < dst_ch; ++c) {
+		size_t span;
+		const float *head = (const float *)sample3d[c].get_span(0, span);
+		const unsigned wrap = clunk_min<unsigned>(dst_n, (unsigned)(span / sizeof(float)));
+		for(unsigned i = 0; i < wrap; ++i) {
+			dst[i * dst_ch + c] = head[i] * vol;
+		}
+		if (wrap < dst_n) {
+			const float *tail = (const float *)sample3d[c].get_span(span, span);
+			for(unsigned i = wrap; i < dst_n; ++i) {
+				dst[i * dst_ch + c] = tail[i - wrap] * vol;
+			}
 		}
 	}
 	
-	_update_position((int)(dst_n * pitch));
+	consume(dst_n, pitch);
 	//LOG_DEBUG(("size2: %u, %u, needed: %u", (unsigned)sample3d[0].get_size(), (unsigned)sample3d[1].get_size(), dst_n));
 	return vol;
 }
 
-#include "kemar.h"
 
 void Source::get_kemar_data(kemar_ptr & kemar_data, int & elev_n, const v3<float> &pos) {
 	
@@ -26,8 +26,12 @@
 #include <SDL_audio.h>
 #include "export_clunk.h"
 #include "v3.h"
+#include "fft_context.h"
+//mdct_context and vorbis_window_func used to come with this header
 #include "mdct_context.h"
 #include "buffer.h"
+#include "ring_buffer.h"
+#include "object.h"
 
 struct kiss_fftr_state;
 
@@ -37,26 +41,31 @@ namespace clunk {
 class Sample;
 class Buffer;
 
-//window function used in ogg/vorbis
-template<int N, typename T>
-struct vorbis_window_func : public clunk::window_func_base<N, T> {
-	inline T operator()(int x) const {
-		T s = sin(T(M_PI) * (x + 0.5f) / N);
-		return sin(T(M_PI_2) * s * s); 
-	}
-};
-
 //!class holding information about source. 
 class CLUNKAPI Source {
 public: 
-	enum { WINDOW_BITS = 9 };
-
-private: 
-	typedef mdct_context<WINDOW_BITS, vorbis_window_func, float> mdct_type;
-	static mdct_type mdct;
+	///length of the block convolved at once, also the latency of the hrtf
+	enum { PARTITION_BITS = 7, PARTITION_SIZE = 1 << PARTITION_BITS };
+	///number of partitions of the 512 taps kemar impulse responses
+	enum { PARTITIONS = 512 / PARTITION_SIZE };
+	///number of transforms done at once, every transform in its own simd lane
+	enum { FFT_LANES = 4 };
+	
+	typedef fft_core<PARTITION_BITS + 1, float> fft_type;
+	enum { FFT_SIZE = fft_type::N };
 
-public:
-	enum { WINDOW_SIZE = mdct_type::N };
+	/*! 
+		\brief convolution scratch state. 
+		Tables are shared, but every thread rendering sources needs its own instance.
+	*/
+	struct hrtf_scratch {
+		///transform lanes, element i of the lane k is at [i][k]
+		float re[FFT_SIZE][FFT_LANES], im[FFT_SIZE][FFT_LANES];
+		///input blocks preceded by the last block of the previous ones
+		float input[(2 * FFT_LANES + 1) * PARTITION_SIZE];
+		///half spectra of the input blocks, bin 0 holds dc in re and nyquist in im
+		float block_re[2 * FFT_LANES][PARTITION_SIZE], block_im[2 * FFT_LANES][PARTITION_SIZE];
+	};
 
 	///pointer to the sample holding audio data
 	const Sample * const sample;
@@ -74,6 +83,14 @@ public:
 		note: panning is actually applied on mono samples in center(listener) position.
 	*/
 	float panning;
+	
+	///interpolation of the sample data used for pitch and doppler effect
+	enum Interpolation { 
+		Linear, ///< 2 points, cheapest, default
+		Cubic, ///< 4 points Catmull-Rom spline
+		Sinc ///< windowed sinc, band-limited: lowers cutoff when pitching up
+	};
+	Interpolation interpolation;
 	/*! 
 		\brief constructs new source
 		\param[in] sample audio data
@@ -93,29 +110,65 @@ public:
 
 	/*! 
 		\brief for the internal use only. DO NOT USE IT. 
-		\internal for the internal use only. 
+		\internal skips dp output samples of the source which was not mixed
 	*/
 	void _update_position(int dp);
 
 	/*! 
 		\brief for the internal use only. DO NOT USE IT. 
-		\internal for the internal use only. 
+		\internal renders dst_n frames of ch channels with the volume already applied, returns the volume or 0 if nothing was written
+	*/
+	float _process(float *dst, unsigned dst_n, unsigned ch, const v3<float> &position, const v3<float> &direction, float fx_volume, float pitch, hrtf_scratch &scratch);
+
+	/*! 
+		\brief for the internal use only. DO NOT USE IT. 
+		\internal preallocates buffers for the periods of the given length, so mixing does not allocate memory
 	*/
-	float _process(clunk::Buffer &buffer, unsigned ch, const v3<float> &position, const v3<float> &direction, float fx_volume, float pitch);
+	void _reserve(unsigned samples);
+
+	/*! 
+		\brief for the internal use only. DO NOT USE IT. 
+		\internal builds tables shared by all sources, called once from Context::init() before audio starts
+	*/
+	static void _init_tables();
 
 private: 
 	typedef const float (*kemar_ptr)[2][512];
 	void get_kemar_data(kemar_ptr & kemar_data, int & samples, const v3<float> &delta_position);
 
-	static void idt_iit(const v3<float> &delta, const v3<float> &direction, float &idt_offset, float &angle_gr, float &left_to_right_amp);
-	//generate hrtf response for channel idx (0 left), in result.
-	void hrtf(int window, const unsigned channel_idx, clunk::Buffer &result, const Sint16 *src, int src_ch, int src_n, int idt_offset, const kemar_ptr& kemar_data, int kemar_idx, float freq_decay);
+	//angle of the source in degrees, clockwise from the direction of the listener
+	static float azimuth(const v3<float> &delta, const v3<float> &direction);
+	//reads n samples of the given channel from the fractional position 'start', 'step' samples apart
+	void fetch(float *dst, int n, double start, float step, const Sint16 *src, int src_ch, int src_n, int channel) const;
+	//advances position by the fractional number of source samples, fraction is kept for the next period
+	void advance(float dp);
+	//moves position by whole source samples, handles looping and fading out
+	void move(int dp);
+	//drops n played output samples of sample3d, advances source position by n * pitch
+	void consume(unsigned n, float pitch);
+	//reads the given number of blocks from the source position 'start', 'pitch' samples apart, and stores their spectra in scratch
+	void analyze(hrtf_scratch &scratch, int blocks, double start, float pitch, const Sint16 *src, int src_ch, int src_n);
+	//convolves analyzed blocks with hrir partitions of both ears and appends the result to sample3d
+	void hrtf(hrtf_scratch &scratch, int first, int blocks, const float *hrir);
 
 	int position, fadeout, fadeout_total;
+	//fractional part of the position, [0, 1)
+	float fraction;
 	
-	clunk::Buffer sample3d[2];
-
-	float overlap_data[2][WINDOW_SIZE / 2];
+	//rendered float samples of both ears at the full volume, waiting to be played
+	clunk::RingBuffer sample3d[2];
+	//source position the next rendered block starts from, valid while sample3d is not empty
+	double rendered_position;
+
+	//last input block, it is transformed again with the next one
+	float input_tail[PARTITION_SIZE];
+	//frequency domain delay line: half spectra of the last input blocks, the newest one is at spectrum_pos
+	float spectrum_re[PARTITIONS][PARTITION_SIZE], spectrum_im[PARTITIONS][PARTITION_SIZE];
+	int spectrum_pos;
+	
+	friend class SourceMap;
+	//link in the sources of the object playing it
+	source_node node;
 };
 }
 
@@ -0,0 +1,167 @@
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "spatial_grid.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace clunk;
+
+SpatialGrid::SpatialGrid() : cell_size(0) {}
+
+void SpatialGrid::reset(float size) {
+	cells.clear();
+	std::fill(table.begin(), table.end(), 0u);
+	slot_type nil = { Nil, Nil };
+	std::fill(slots.begin(), slots.end(), nil);
+	cell_size = size > 0? size: 0;
+}
+
+void SpatialGrid::reserve(unsigned handles) {
+	if (handles <= slots.size())
+		return;
+	
+	slot_type nil = { Nil, Nil };
+	slots.resize(handles, nil);
+	cells.reserve(handles);
+	
+	size_t size = 16;
+	while(size < 2 * (size_t)handles)
+		size *= 2;
+	if (size <= table.size())
+		return;
+	
+	table.assign(size, 0u);
+	for(size_t i = 0; i < cells.size(); ++i) 
+		table[lookup(cells[i].cell)] = (unsigned)i + 1;
+}
+
+SpatialGrid::cell_type SpatialGrid::get_cell(const v3<float> &pos) const {
+	if (cell_size <= 0)
+		return cell_type();
+	return cell_type((int)floorf(pos.x / cell_size), (int)floorf(pos.y / cell_size), (int)floorf(pos.z / cell_size));
+}
+
+unsigned SpatialGrid::hash(const cell_type &cell) {
+	return ((unsigned)cell.x * 73856093u) ^ ((unsigned)cell.y * 19349663u) ^ ((unsigned)cell.z * 83492791u);
+}
+
+unsigned SpatialGrid::lookup(const cell_type &cell) const {
+	const unsigned mask = (unsigned)table.size() - 1;
+	unsigned slot = hash(cell) & mask;
+	while(table[slot] != 0 && !(cells[table[slot] - 1].cell == cell))
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+void SpatialGrid::erase_slot(unsigned slot) {
+	//backward shift deletion, no tombstones left behind
+	const unsigned mask = (unsigned)table.size() - 1;
+	unsigned hole = slot;
+	for(unsigned i = (slot + 1) & mask; table[i] != 0; i = (i + 1) & mask) {
+		unsigned home = hash(cells[table[i] - 1].cell) & mask;
+		//move entry to the hole if the hole lies between its home slot and the entry itself
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			table[hole] = table[i];
+			hole = i;
+		}
+	}
+	table[hole] = 0;
+}
+
+void SpatialGrid::insert(unsigned handle, const cell_type &cell) {
+	if (handle >= slots.size())
+		reserve(handle + 1);
+	
+	unsigned slot = lookup(cell);
+	if (table[slot] == 0) {
+		cells.push_back(cell_entry(cell));
+		table[slot] = (unsigned)cells.size();
+	}
+	cell_entry &c = cells[table[slot] - 1];
+	
+	slot_type &s = slots[handle];
+	s.prev = Nil;
+	s.next = c.first;
+	if (c.first != Nil)
+		slots[c.first].prev = handle;
+	c.first = handle;
+	++c.count;
+}
+
+void SpatialGrid::remove(unsigned handle, const cell_type &cell) {
+	if (handle >= slots.size() || table.empty())
+		return;
+	
+	unsigned slot = lookup(cell);
+	if (table[slot] == 0)
+		return;
+	unsigned index = table[slot] - 1;
+	cell_entry &c = cells[index];
+	
+	slot_type &s = slots[handle];
+	if (s.prev != Nil)
+		slots[s.prev].next = s.next;
+	else if (c.first == handle)
+		c.first = s.next;
+	else
+		return; //not in this cell
+	if (s.next != Nil)
+		slots[s.next].prev = s.prev;
+	s.next = s.prev = Nil;
+	if (--c.count != 0)
+		return;
+	
+	erase_slot(slot);
+	unsigned last = (unsigned)cells.size() - 1;
+	if (index != last) {
+		cells[index] = cells[last];
+		table[lookup(cells[index].cell)] = index + 1;
+	}
+	cells.pop_back();
+}
+
+void SpatialGrid::query(const v3<float> &center, float radius, std::vector<unsigned> &result) const {
+	if (cell_size <= 0 || cells.empty())
+		return;
+	
+	const cell_type lo = get_cell(center - radius), hi = get_cell(center + radius);
+	const double range = ((double)hi.x - lo.x + 1) * ((double)hi.y - lo.y + 1) * ((double)hi.z - lo.z + 1);
+	
+	if (range > (double)cells.size()) {
+		//less cells populated than covered by the sphere, check them all
+		for(std::vector<cell_entry>::const_iterator i = cells.begin(); i != cells.end(); ++i) {
+			const cell_type &c = i->cell;
+			if (c.x < lo.x || c.x > hi.x || c.y < lo.y || c.y > hi.y || c.z < lo.z || c.z > hi.z)
+				continue;
+			for(unsigned h = i->first; h != Nil; h = slots[h].next)
+				result.push_back(h);
+		}
+		return;
+	}
+	
+	for(int x = lo.x; x <= hi.x; ++x) 
+		for(int y = lo.y; y <= hi.y; ++y) 
+			for(int z = lo.z; z <= hi.z; ++z) {
+				unsigned slot = table[lookup(cell_type(x, y, z))];
+				if (slot == 0)
+					continue;
+				for(unsigned h = cells[slot - 1].first; h != Nil; h = slots[h].next)
+					result.push_back(h);
+			}
+}
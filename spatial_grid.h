@@ -0,0 +1,104 @@
+#ifndef CLUNK_SPATIAL_GRID_H__
+#define CLUNK_SPATIAL_GRID_H__
+
+/* libClunk - cross-platform 3D audio API built on top SDL library
+ * Copyright (C) 2007-2008 Netive Media Group
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <vector>
+#include "export_clunk.h"
+#include "v3.h"
+
+namespace clunk {
+
+/*! 
+	\brief Uniform grid of objects. 
+	Used by clunk::Context to skip objects which are too far from the listener. 
+	Objects are identified by context's handles. 
+	Grid does not track objects positions itself, owner passes cell of the object explicitly.
+	Cells live in the open-addressed hash table preallocated by reserve(), objects of the cell 
+	are linked through the per-handle slots, so insert and remove never allocate.
+*/
+
+class CLUNKAPI SpatialGrid {
+public: 
+	typedef v3<int> cell_type;
+	
+	SpatialGrid();
+	
+	/*! 
+		\brief removes all objects and sets new cell size
+		\param[in] cell_size size of the cell, 0 disables grid.
+	*/
+	void reset(float cell_size);
+	
+	///preallocates room for handles [0, handles), the only method which could allocate besides reset() and query()
+	void reserve(unsigned handles);
+	
+	///returns true if grid was initialized with non-zero cell size
+	inline bool enabled() const { return cell_size > 0; }
+	
+	///returns cell containing given position
+	cell_type get_cell(const v3<float> &pos) const;
+	
+	///adds object to the given cell
+	void insert(unsigned handle, const cell_type &cell);
+	///removes object from the given cell
+	void remove(unsigned handle, const cell_type &cell);
+	
+	/*! 
+		\brief appends objects from all cells intersecting given sphere
+		\param[in] center center of the sphere
+		\param[in] radius radius of the sphere
+		\param[out] result objects' handles, some of them could be outside of the sphere.
+	*/
+	void query(const v3<float> &center, float radius, std::vector<unsigned> &result) const;
+	
+private: 
+	float cell_size;
+	
+	enum { Nil = ~0u };
+	
+	struct cell_entry {
+		cell_type cell;
+		//first object of the cell and number of objects
+		unsigned first, count;
+		inline cell_entry(const cell_type &cell) : cell(cell), first(Nil), count(0) {}
+	};
+	//non-empty cells, removed with swap-and-pop
+	std::vector<cell_entry> cells;
+	
+	//open-addressed hash table with linear probing, holds index of the cell + 1, 0 marks free slot.
+	//size is power of two at least twice larger than number of handles, so it is never more than half full.
+	std::vector<unsigned> table;
+	
+	struct slot_type {
+		unsigned next, prev;
+	};
+	//objects' links inside their cells, indexed by handle
+	std::vector<slot_type> slots;
+	
+	static unsigned hash(const cell_type &cell);
+	//returns table slot holding the cell or free slot where it should be inserted
+	unsigned lookup(const cell_type &cell) const;
+	//removes table slot keeping probe sequences of the other cells intact
+	void erase_slot(unsigned slot);
+};
+
+}
+
+#endif
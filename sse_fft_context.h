@@ -1,6 +1,11 @@
 #ifndef CLUNK_SSE_FFT_CONTEXT_H__
 #define CLUNK_SSE_FFT_CONTEXT_H__
 
+/*
+	SSE version of fft_context<BITS, float>. fft_context.h does not include it, so the layout of the public classes 
+	does not depend on CLUNK_USES_SSE: include it explicitly in every translation unit using fft_context<BITS, float>.
+	Library has to be built with WITH_SSE for aligned_allocator.
+*/
 #ifndef CLUNK_USES_SSE
 #	error turn on SSE support with CLUNK_USES_SSE macro
 #endif
@@ -13,10 +18,12 @@
 #include <xmmintrin.h>
 #include <complex>
 #include "clunk_assert.h"
+#include "cpu_features.h"
+#include "fft_context.h"
 
 namespace clunk {
 
-struct aligned_allocator {
+struct CLUNKAPI aligned_allocator {
 	static void * allocate(size_t size, size_t alignment);
 	static void deallocate(void *ptr);
 };
@@ -42,17 +49,19 @@ struct sse_danielson_lanczos {
 	aligned_array<sse_type, N / 2> angle_re;
 	aligned_array<sse_type, N / 2> angle_im;
 	
+	//tables are read-only after construction and shared between all fft contexts
+	static const sse_danielson_lanczos & get_shared() {
+		static const sse_danielson_lanczos shared;
+		return shared;
+	}
+	
 	sse_danielson_lanczos() {
-		T a = (T)(-2 * M_PI / N / SSE_DIV);
-		T wtemp = sin(a / 2);
-		
-		std::complex<T> wp (-2 * wtemp * wtemp, sin(a)), w(1, 0);
+		const double a = -2 * M_PI / N / SSE_DIV;
 		for (unsigned i = 0; i < N / 2 ; ++i) {
 			T w_re_buf[SSE_DIV], w_im_buf[SSE_DIV];
 			for (unsigned k = 0; k < SSE_DIV; ++k) {
-				w_re_buf[k] = w.real();
-				w_im_buf[k] = w.imag();
-				w += w * wp;
+				w_re_buf[k] = (T)cos(a * (i * SSE_DIV + k));
+				w_im_buf[k] = (T)sin(a * (i * SSE_DIV + k));
 			}
 
 			angle_re[i] = _mm_loadu_ps(w_re_buf);
@@ -61,7 +70,7 @@ struct sse_danielson_lanczos {
 	}
 
 	template<int SIGN>
-	void apply(sse_type * data_re, sse_type * data_im) {
+	void apply(sse_type * data_re, sse_type * data_im) const {
 		next.template apply<SIGN>(data_re, data_im);
 		next.template apply<SIGN>(data_re + N / 2, data_im + N / 2);
 			
@@ -81,36 +90,31 @@ struct sse_danielson_lanczos {
 	}
 };
 
+//4 point transform within the single register, input is bit-reversed
 template<typename T>
 struct sse_danielson_lanczos<1, T> {
 	typedef __m128 sse_type;
-	enum { SSE_DIV = sizeof(sse_type) / sizeof(T) };
-
-	typedef danielson_lanczos<SSE_DIV, T> next_type;
 
 	template<int SIGN>
-	static void apply(sse_type * data_re, sse_type * data_im) {
-		T re[SSE_DIV], im[SSE_DIV]; 
-		_mm_storeu_ps(re, *data_re);
-		_mm_storeu_ps(im, *data_im);
-
-		std::complex<T> data[SSE_DIV];
-		for(unsigned i = 0; i < SSE_DIV; ++i) {
-			data[i] = std::complex<T>(re[i], im[i]);
-		}
-		
-		next_type::template apply<SIGN>(data);
-
-		for(unsigned i = 0; i < SSE_DIV; ++i) {
-			re[i] = data[i].real();
-			im[i] = data[i].imag();
-		}
+	static inline void apply(sse_type * data_re, sse_type * data_im) {
+		//x0 + x1, x0 - x1, x2 + x3, x2 - x3
+		const sse_type sign1 = _mm_setr_ps(1, -1, 1, -1);
+		sse_type re = _mm_add_ps(_mm_shuffle_ps(*data_re, *data_re, _MM_SHUFFLE(2, 2, 0, 0)), _mm_mul_ps(_mm_shuffle_ps(*data_re, *data_re, _MM_SHUFFLE(3, 3, 1, 1)), sign1));
+		sse_type im = _mm_add_ps(_mm_shuffle_ps(*data_im, *data_im, _MM_SHUFFLE(2, 2, 0, 0)), _mm_mul_ps(_mm_shuffle_ps(*data_im, *data_im, _MM_SHUFFLE(3, 3, 1, 1)), sign1));
 		
-		*data_re = _mm_loadu_ps(re);
-		*data_im = _mm_loadu_ps(im);
+		//b0 +- b2, b1 +- b3 * -i * SIGN
+		sse_type high = _mm_shuffle_ps(re, im, _MM_SHUFFLE(3, 2, 3, 2)); //re2 re3 im2 im3
+		sse_type q_re = _mm_mul_ps(_mm_shuffle_ps(high, high, _MM_SHUFFLE(3, 0, 3, 0)), _mm_setr_ps(1, SIGN, -1, -SIGN));
+		sse_type q_im = _mm_mul_ps(_mm_shuffle_ps(high, high, _MM_SHUFFLE(1, 2, 1, 2)), _mm_setr_ps(1, -SIGN, -1, SIGN));
+		*data_re = _mm_add_ps(_mm_shuffle_ps(re, re, _MM_SHUFFLE(1, 0, 1, 0)), q_re);
+		*data_im = _mm_add_ps(_mm_shuffle_ps(im, im, _MM_SHUFFLE(1, 0, 1, 0)), q_im);
 	}
 };
 
+/*!
+	transform works on the split real and imaginary arrays. 
+	mdct_context fills them directly with set(), complex data[] is converted to them and back on every fft()/ifft() call
+*/
 template<int BITS>
 class fft_context<BITS, float> {
 public: 
@@ -119,83 +123,75 @@ public:
 	enum { SSE_DIV = sizeof(sse_type) / sizeof(float) };
 	enum { SSE_N = (N - 1) / SSE_DIV + 1 };
 
-	//clunk_static_assert(SSE_DIV == 4);
+	clunk_static_assert(N % SSE_DIV == 0);
 
 private:
 	aligned_array<sse_type, SSE_N> data_re;
 	aligned_array<sse_type, SSE_N> data_im;
+	float *split_re, *split_im;
 
 public: 
 
 	typedef std::complex<float> value_type;
 	value_type data[N];
 	
+	fft_context() : split_re((float *)(sse_type *)data_re), split_im((float *)(sse_type *)data_im), next(next_type::get_shared()), scalar(scalar_type::get_shared()) {}
+
+	inline void set(unsigned i, float re, float im) { split_re[i] = re; split_im[i] = im; }
+	inline float re(unsigned i) const { return split_re[i]; }
+	inline float im(unsigned i) const { return split_im[i]; }
+
+	//forward transform of the data filled with set()
+	inline void transform() {
+		if (!cpu_features::has(cpu_features::SSE2)) {
+			save();
+			scalar.template apply<1>(data);
+			load();
+			return;
+		}
+		scalar.permute(split_re, split_im);
+		next.template apply<1>(data_re, data_im);
+	}
+
 	inline void fft() {
-		scramble(data);
 		load();
-		next.template apply<1>(data_re, data_im);
+		transform();
 		save();
 	}
 
 	inline void ifft() {
-		scramble(data);
-		load();
-		next.template apply<-1>(data_re, data_im);
-
-		sse_type n = _mm_set_ps1(N);
-		for(unsigned i = 0; i < SSE_N; ++i) {
-			data_re[i] = _mm_div_ps(data_re[i], n);
-			data_im[i] = _mm_div_ps(data_im[i], n);
+		if (!cpu_features::has(cpu_features::SSE2)) {
+			scalar.template apply<-1>(data);
+		} else {
+			load();
+			scalar.permute(split_re, split_im);
+			next.template apply<-1>(data_re, data_im);
+			save();
+		}
+		for(unsigned i = 0; i < N; ++i) {
+			data[i] /= N;
 		}
-		save();
 	}
 
 private:
-	sse_danielson_lanczos<SSE_N, float> next;
-
-	static void scramble(std::complex<float> * data) {
-		int j = 0;
-		for(int i = 0; i < N; ++i) {
-			if (i > j) {
-				std::swap(data[i], data[j]);
-			}
-			int m = N / 2;
-			while(j >= m && m >= 2) {
-				j -= m;
-				m >>= 1;
-			}
-			j += m;
-		}
-	}
+	typedef sse_danielson_lanczos<SSE_N, float> next_type;
+	const next_type &next;
+	//bit-reverse permutation and fallback for the cpus without sse2
+	typedef fft_core<BITS, float> scalar_type;
+	const scalar_type &scalar;
 
 	void load() {
-		for(int i = 0; i < SSE_N; ++i) {
-			float buf_re[SSE_DIV], buf_im[SSE_DIV];
-			for(int j = 0; j < SSE_DIV; ++j) {
-				int idx = i * SSE_DIV + j; 
-				buf_re[j] = (idx < N)? data[idx].real(): 0;
-				buf_im[j] = (idx < N)? data[idx].imag(): 0;
-			}
-			data_re[i] = _mm_loadu_ps(buf_re);
-			data_im[i] = _mm_loadu_ps(buf_im);
+		for(unsigned i = 0; i < N; ++i) {
+			split_re[i] = data[i].real();
+			split_im[i] = data[i].imag();
 		}
 	}
 
 	void save() {
-		for(int i = 0; i < SSE_N; ++i) {
-			float buf_re[SSE_DIV], buf_im[SSE_DIV];
-			_mm_storeu_ps(buf_re, data_re[i]);
-			_mm_storeu_ps(buf_im, data_im[i]);
-			
-			for(int j = 0; j < SSE_DIV; ++j) {
-				int idx = i * SSE_DIV + j;
-				if (idx >= N)
-					break;
-				data[idx] = value_type(buf_re[j], buf_im[j]);
-			}
+		for(unsigned i = 0; i < N; ++i) {
+			data[i] = value_type(split_re[i], split_im[i]);
 		}
 	}
-
 };
 
 }
@@ -22,4 +22,10 @@ using namespace clunk;
 
 Stream::Stream() : sample_rate(0), format(0), channels(0) {}
 
+bool Stream::read_into(void *, unsigned, unsigned &written, bool &eos) {
+	written = 0;
+	eos = false;
+	return false;
+}
+
 Stream::~Stream() {}
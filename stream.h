@@ -49,6 +49,20 @@ public:
 		\param[in] hint points out for the recommented data size. You could read less or more hint. 
 	*/
 	virtual bool read(clunk::Buffer &data, unsigned hint) = 0;
+	
+	/*! 
+		\brief reads data right into the mixer's memory, without intermediate buffer. 
+		Called only if stream has the same sample rate and format as the context. 
+		Default implementation returns false and context falls back to read(clunk::Buffer &, unsigned).
+		There is no minimum size: destination is the free space up to the end of the ring and could be as small as a few bytes. 
+		If not even one frame fits, return true with written = 0: context reads the rest of the period with read().
+		\param[out] data destination memory
+		\param[in] size size of the destination, do not write more.
+		\param[out] written number of bytes written
+		\param[out] eos set it to true if stream has ended
+		\return false if stream does not support reading into memory
+	*/
+	virtual bool read_into(void *data, unsigned size, unsigned &written, bool &eos);
 	virtual ~Stream();
 
 protected: 
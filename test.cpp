@@ -1,12 +1,290 @@
 #include "context.h"
 #include "source.h"
+#include "sample.h"
+#include "stream.h"
+#include "object.h"
+#include "cpu_features.h"
+#include "kemar.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <new>
+
+//allocations made by the rendering threads of the context, set only around process(): main thread produces commands too
+static const clunk::Context *counted_context = NULL;
+static volatile unsigned rendering_allocations = 0;
+
+void *operator new(size_t size) {
+	if (counted_context != NULL && counted_context->is_rendering_thread())
+		++rendering_allocations;
+	void *p = malloc(size > 0? size: 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) throw() {
+	free(p);
+}
 
 #define WINDOW_BITS 9
 
 typedef clunk::mdct_context<WINDOW_BITS, clunk::vorbis_window_func, float> mdct_type;
 typedef clunk::fft_context<WINDOW_BITS - 2, float> fft_type;
 
+//naive O(n^2) transform in double precision, sign = 1 for the forward one
+static void dft(const std::complex<double> *src, std::complex<double> *dst, int n, int sign) {
+	for(int k = 0; k < n; ++k) {
+		std::complex<double> sum = 0;
+		for(int i = 0; i < n; ++i) {
+			double a = -2 * M_PI * sign * ((double)i * k / n);
+			sum += src[i] * std::complex<double>(cos(a), sin(a));
+		}
+		dst[k] = sum;
+	}
+}
+
+//maximum difference between transforms relative to the largest bin of the expected one
+template<typename T>
+static double fft_error(const T *re, const T *im, int stride, const std::complex<double> *expected, int n) {
+	double err = 0, peak = 0;
+	for(int i = 0; i < n; ++i) {
+		err = std::max(err, std::abs(std::complex<double>(re[i * stride], im[i * stride]) - expected[i]));
+		peak = std::max(peak, std::abs(expected[i]));
+	}
+	return err / peak;
+}
+
+//checks fft_core::apply, apply_batch and fft_context round trip against the dft
+template<int BITS>
+static bool check_fft() {
+	typedef clunk::fft_core<BITS, float> core_type;
+	enum { N = core_type::N, LANES = 4 };
+	static const double tolerance = 1e-5;
+	const core_type &core = core_type::get_shared();
+	double apply_err = 0, batch_err = 0, context_err = 0;
+	
+	std::complex<double> input[LANES][N], expected[2][LANES][N];
+	for(int l = 0; l < LANES; ++l) {
+		for(int i = 0; i < N; ++i) {
+			input[l][i] = std::complex<double>(rand() / (double)RAND_MAX - 0.5, rand() / (double)RAND_MAX - 0.5);
+		}
+		dft(input[l], expected[0][l], N, 1);
+		dft(input[l], expected[1][l], N, -1);
+	}
+	
+	for(int d = 0; d < 2; ++d) {
+		std::complex<float> data[N];
+		for(int i = 0; i < N; ++i) {
+			data[i] = std::complex<float>((float)input[0][i].real(), (float)input[0][i].imag());
+		}
+		if (d == 0)
+			core.template apply<1>(data);
+		else
+			core.template apply<-1>(data);
+		
+		const float *d_re = reinterpret_cast<float *>(data), *d_im = d_re + 1;
+		apply_err = std::max(apply_err, fft_error(d_re, d_im, 2, expected[d][0], N));
+		
+		float re[N * LANES], im[N * LANES];
+		for(int i = 0; i < N; ++i) {
+			for(int l = 0; l < LANES; ++l) {
+				re[i * LANES + l] = (float)input[l][i].real();
+				im[i * LANES + l] = (float)input[l][i].imag();
+			}
+		}
+		if (d == 0)
+			core.template apply_batch<1, LANES>(re, im);
+		else
+			core.template apply_batch<-1, LANES>(re, im);
+		
+		for(int l = 0; l < LANES; ++l) {
+			batch_err = std::max(batch_err, fft_error(re + l, im + l, LANES, expected[d][l], N));
+		}
+	}
+	
+	clunk::fft_context<BITS, float> fft;
+	for(int i = 0; i < N; ++i) {
+		fft.data[i] = std::complex<float>((float)input[0][i].real(), (float)input[0][i].imag());
+	}
+	fft.fft();
+	const float *f_re = reinterpret_cast<float *>(fft.data), *f_im = f_re + 1;
+	context_err = fft_error(f_re, f_im, 2, expected[0][0], N);
+	fft.ifft();
+	context_err = std::max(context_err, fft_error(f_re, f_im, 2, input[0], N));
+	
+	printf("%d points, errors: apply %g, apply_batch %g, fft_context %g\n", (int)N, apply_err, batch_err, context_err);
+	return apply_err < tolerance && batch_err < tolerance && context_err < tolerance;
+}
+
+//renders noise from the given horizontal angle and compares it with the direct convolution of the kemar impulse responses. 
+//pitched source is read with linear interpolation, the default one
+static bool check_hrtf(int angle, float pitch, unsigned features) {
+	enum { PERIOD = 1000, PERIODS = 20, LENGTH = 2 * PERIOD * PERIODS };
+	clunk::Source::_init_tables();
+	static clunk::Source::hrtf_scratch scratch;
+	
+	static Sint16 noise[LENGTH];
+	for(int i = 0; i < LENGTH; ++i) {
+		noise[i] = (Sint16)(rand() % 16384 - 8192);
+	}
+	clunk::Buffer data;
+	data.set_data(noise, sizeof(noise));
+	
+	clunk::Context context;
+	context.init(44100, 2, 1024);
+	//forcing the given kernels, features detected by init() are kept
+	clunk::cpu_features::features &= features;
+	clunk::Sample *sample = context.create_sample();
+	sample->init(data, 44100, AUDIO_S16SYS, 1);
+	clunk::Source source(sample);
+	
+	//listener looks along y, angles are clockwise
+	const float a = (float)(angle * M_PI / 180);
+	const clunk::v3<float> delta(3 * sin(a), 3 * cos(a), 0), direction(0, 1, 0);
+	const int kemar_idx = angle / 5;
+	
+	static float input[PERIOD * PERIODS];
+	for(int t = 0; t < PERIOD * PERIODS; ++t) {
+		double pos = t * (double)pitch;
+		int p = (int)floor(pos);
+		float f = (float)(pos - p);
+		input[t] = noise[p] + f * (noise[p + 1] - noise[p]);
+	}
+	
+	double max_diff = 0;
+	static float out[PERIOD * 2];
+	for(int p = 0; p < PERIODS; ++p) {
+		source._process(out, PERIOD, 2, delta, direction, 1, pitch, scratch);
+		for(int i = 0; i < PERIOD; ++i) {
+			const int t = p * PERIOD + i;
+			for(int c = 0; c < 2; ++c) {
+				double y = 0;
+				for(int k = 0; k < 512 && k <= t; ++k) {
+					y += elev_0[kemar_idx][c][k] * input[t - k];
+				}
+				max_diff = std::max(max_diff, fabs(y - out[i * 2 + c]));
+			}
+		}
+	}
+	delete sample;
+	context.deinit();
+	printf("hrtf at %d degrees, pitch %g, features %u: maximum difference %g\n", angle, pitch, clunk::cpu_features::features, max_diff);
+	return max_diff < 0.05;
+}
+
+//random inserts, moves and removes checked against the brute force scan
+static bool check_grid() {
+	enum { N = 500 };
+	clunk::SpatialGrid grid;
+	grid.reset(2);
+	grid.reserve(N);
+	std::vector<clunk::v3<float> > position(N);
+	std::vector<bool> alive(N);
+	srand(1);
+	bool ok = true;
+	for(int step = 0; step < 20000 && ok; ++step) {
+		unsigned h = rand() % N;
+		clunk::v3<float> pos((rand() % 2000) / 50.0f - 20, (rand() % 2000) / 50.0f - 20, (rand() % 200) / 50.0f - 2);
+		if (alive[h])
+			grid.remove(h, grid.get_cell(position[h]));
+		alive[h] = rand() % 4 != 0;
+		position[h] = pos;
+		if (alive[h])
+			grid.insert(h, grid.get_cell(pos));
+		
+		if (step % 100 != 0)
+			continue;
+		const clunk::v3<float> center((rand() % 40) - 20.0f, (rand() % 40) - 20.0f, 0);
+		const float radius = (float)(rand() % 30);
+		std::vector<unsigned> result;
+		grid.query(center, radius, result);
+		std::vector<bool> found(N);
+		for(size_t i = 0; i < result.size(); ++i) {
+			if (!alive[result[i]] || found[result[i]])
+				ok = false;
+			found[result[i]] = true;
+		}
+		for(unsigned i = 0; i < N; ++i) {
+			if (alive[i] && !found[i] && position[i].distance(center) <= radius)
+				ok = false;
+		}
+	}
+	return ok;
+}
+
+//endless tone at the rate different from the context's one, so it goes through the resampler
+struct tone_stream : public clunk::Stream {
+	int pos;
+	tone_stream() : pos(0) { sample_rate = 22050; format = AUDIO_S16SYS; channels = 2; }
+	void rewind() { pos = 0; }
+	bool read(clunk::Buffer &data, unsigned hint) {
+		//odd length moves the chunk boundaries around the filter history
+		enum { FRAMES = 777 };
+		data.set_size(FRAMES * 4);
+		Sint16 *dst = (Sint16 *)data.get_ptr();
+		for(int i = 0; i < FRAMES; ++i, ++pos) 
+			dst[2 * i] = dst[2 * i + 1] = (Sint16)(8000 * sin(pos * 0.05));
+		return true;
+	}
+};
+
+//plays, moves and cancels sources between the periods, counting operator new calls made while rendering
+static bool check_allocations() {
+	enum { OBJECTS = 64, PERIODS = 200, WARMUP = 20 };
+	static Sint16 noise[22050];
+	for(int i = 0; i < 22050; ++i) 
+		noise[i] = (Sint16)(rand() % 16384 - 8192);
+	clunk::Buffer data;
+	data.set_data(noise, sizeof(noise));
+	
+	clunk::Context context;
+	context.init(44100, 2, 1024);
+	context.set_max_sources(16);
+	context.set_threads(2);
+	context.set_distance_model(clunk::DistanceModel(clunk::DistanceModel::Linear, true, 20));
+	context.set_spatial_index(4);
+	clunk::Sample *sample = context.create_sample();
+	sample->init(data, 22050, AUDIO_S16SYS, 1);
+	context.play(0, new tone_stream, true);
+	
+	std::vector<clunk::Object *> objects;
+	for(int i = 0; i < OBJECTS; ++i) 
+		objects.push_back(context.create_object());
+	//interning the names is the producer's work
+	objects[0]->play("a", new clunk::Source(sample, true));
+	objects[0]->play("b", new clunk::Source(sample, true));
+	
+	const int len = context.get_spec().samples * context.get_spec().channels * 2;
+	std::vector<Sint16> stream(len / 2);
+	unsigned buffers = 0;
+	for(int p = 0; p < PERIODS; ++p) {
+		for(int i = 0; i < OBJECTS; ++i) {
+			const float a = (float)(i + p * 0.05);
+			objects[i]->update(clunk::v3<float>((i % 16) * cos(a), (i % 16) * sin(a), 0), clunk::v3<float>(), clunk::v3<float>(0, 1, 0));
+		}
+		clunk::Object *o = objects[p % OBJECTS];
+		o->play(p % 3 != 0? "a": "b", new clunk::Source(sample, false, clunk::v3<float>(), 1, 0.5f + (p % 5) * 0.25f));
+		o->play(p % 4, new clunk::Source(sample, true));
+		o->cancel(p % 4 + 1, p % 2? 0.1f: 0);
+		
+		if (p == WARMUP)
+			buffers = context.get_buffer_allocations();
+		if (p >= WARMUP)
+			counted_context = &context;
+		context.process(&stream[0], len);
+		counted_context = NULL;
+	}
+	buffers = context.get_buffer_allocations() - buffers;
+	
+	for(int i = 0; i < OBJECTS; ++i) 
+		delete objects[i];
+	delete sample;
+	context.deinit();
+	printf("allocations after warmup: operator new %u, buffers %u\n", (unsigned)rendering_allocations, buffers);
+	return rendering_allocations == 0 && buffers == 0;
+}
+
 int main(int argc, char *argv[]) {
 	if (argc > 1 && argv[1][0] == 'b' && argv[1][1] == 'm') {
 		mdct_type mdct;
@@ -21,22 +299,31 @@ int main(int argc, char *argv[]) {
 		return 0;
 	}
 	if (argc > 1 && argv[1][0] == 't') {
-		fft_type fft;
-		for(int i = 0; i < fft_type::N; ++i) {
-			fft.data[i] = std::complex<float>((i / 4) & 1, 0);
-		}
-		fft.fft();
-		for(int i = 0; i < fft_type::N; ++i) {
-			printf("%f, %f = %f\n", fft.data[i].real(), fft.data[i].imag(), std::abs(fft.data[i]));
-		}
-		fft.ifft();
-
-		for(int i = 0; i < fft_type::N; ++i) {
-			fft.data[i] -= std::complex<float>((i / 4) & 1, 0);
-			printf("%f, %f\n", fft.data[i].real(), fft.data[i].imag());
+		//odd number of bits takes the additional radix-2 pass
+		bool ok = check_fft<2>() & check_fft<3>() & check_fft<4>() & check_fft<7>() & check_fft<8>() & check_fft<10>();
+		printf("fft: %s\n", ok? "ok": "FAILED");
+		return ok? 0: 1;
+	}
+	if (argc > 1 && argv[1][0] == 'h') {
+		//every kernel level down to the scalar code
+		static const unsigned features[] = { ~0u, clunk::cpu_features::SSE2 | clunk::cpu_features::AVX, clunk::cpu_features::SSE2, 0 };
+		bool ok = true;
+		for(int f = 0; f < 4; ++f) {
+			ok &= check_hrtf(0, 1, features[f]) & check_hrtf(90, 1, features[f]) & check_hrtf(270, 1, features[f]) & 
+				check_hrtf(90, 0.5f, features[f]) & check_hrtf(270, 1.5f, features[f]);
 		}
-		
-		return 0;
+		printf("hrtf: %s\n", ok? "ok": "FAILED");
+		return ok? 0: 1;
+	}
+	if (argc > 1 && argv[1][0] == 'a') {
+		bool ok = check_allocations();
+		printf("allocations: %s\n", ok? "ok": "FAILED");
+		return ok? 0: 1;
+	}
+	if (argc > 1 && argv[1][0] == 'g') {
+		bool ok = check_grid();
+		printf("grid: %s\n", ok? "ok": "FAILED");
+		return ok? 0: 1;
 	}
 	clunk::Context context;
 	context.init(44100, 2, 1024);